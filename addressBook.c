@@ -1,550 +1,6438 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-// Contact structure definition
-typedef struct Contact {
-    char *firstName;
-    char *familyName;
-    long long phoneNum; // 10-digit phone number as 64-bit integer
-    char *address;
-    int age;
-} Contact;
-
-// Function prototypes (as required, unchanged)
-int countContacts(Contact **contacts);
-Contact *readNewContact();
-Contact **appendContact(Contact **contacts, Contact *newContact);
-Contact **insertContactAlphabetical(Contact **contacts, Contact *newContact);
-Contact **removeContactByIndex(Contact **contacts);
-int removeContactByFullName(Contact ***contacts);
-void listContacts(Contact **contacts);
-void saveContactsToFile(Contact **contacts, char *filename);
-void printContactsToFile(Contact **contacts, char *filename);
-Contact **loadContactsFromFile(char *filename);
-Contact **appendContactsFromFile(Contact **contacts, char *filename);
-Contact **mergeContactsFromFile(Contact **contacts, char *filename);
-Contact *editContact(Contact **contacts, int index);
-
-// Helper function to free a Contact
-void freeContact(Contact *contact) {
-    if (contact) {
-        free(contact->firstName);
-        free(contact->familyName);
-        free(contact->address);
-        free(contact);
-    }
-}
-
-// Helper function to check for duplicates
-int isDuplicate(Contact **contacts, Contact *newContact) {
-    int count = countContacts(contacts);
-    for (int i = 0; i < count; i++) {
-        if (strcmp(contacts[i]->firstName, newContact->firstName) == 0 &&
-            strcmp(contacts[i]->familyName, newContact->familyName) == 0) {
-            return 1;
-        }
-    }
-    return 0;
-}
-
-// Count contacts in NULL-terminated array
-int countContacts(Contact **contacts) {
-    if (!contacts) return 0;
-    int count = 0;
-    while (contacts[count] != NULL) count++;
-    return count;
-}
-
-// Read and validate new contact details
-Contact *readNewContact() {
-    Contact *newContact = (Contact *)malloc(sizeof(Contact));
-    if (!newContact) {
-        printf("Error: Memory allocation failed for Contact in readNewContact\n");
-        return NULL;
-    }
-    char buffer[256];
-    int attempts;
-
-    // First name
-    printf("Enter the first name: ");
-    fgets(buffer, sizeof(buffer), stdin);
-    buffer[strcspn(buffer, "\n")] = 0;
-    newContact->firstName = (char *)malloc(strlen(buffer) + 1);
-    if (!newContact->firstName) {
-        printf("Error: unable to allocate memory for the first name string\n");
-        free(newContact);
-        return NULL;
-    }
-    strcpy(newContact->firstName, buffer);
-
-    // Family name
-    printf("Enter the family name: ");
-    fgets(buffer, sizeof(buffer), stdin);
-    buffer[strcspn(buffer, "\n")] = 0;
-    newContact->familyName = (char *)malloc(strlen(buffer) + 1);
-    if (!newContact->familyName) {
-        printf("Error: unable to allocate memory for the family name string\n");
-        free(newContact->firstName);
-        free(newContact);
-        return NULL;
-    }
-    strcpy(newContact->familyName, buffer);
-
-    // Address
-    printf("Enter the address: ");
-    fgets(buffer, sizeof(buffer), stdin);
-    buffer[strcspn(buffer, "\n")] = 0;
-    newContact->address = (char *)malloc(strlen(buffer) + 1);
-    if (!newContact->address) {
-        printf("Error: unable to allocate memory for the address string\n");
-        free(newContact->firstName);
-        free(newContact->familyName);
-        free(newContact);
-        return NULL;
-    }
-    strcpy(newContact->address, buffer);
-
-    // Phone number
-    attempts = 0;
-    while (attempts < 5) {
-        printf("Enter 10-digit phone number that must not start with 0: ");
-        if (scanf("%lld", &newContact->phoneNum) == 1) {
-            char phoneStr[20];
-            sprintf(phoneStr, "%lld", newContact->phoneNum);
-            if (strlen(phoneStr) == 10 && phoneStr[0] != '0') break;
-        }
-        printf("Error: Invalid phone number. Try again:\n");
-        while (getchar() != '\n');
-        attempts++;
-    }
-    if (attempts == 5) {
-        printf("Error: Could not read a valid phone number\n");
-        newContact->phoneNum = 0;
-    }
-
-    // Age
-    attempts = 0;
-    while (attempts < 5) {
-        printf("Enter the age: ");
-        if (scanf("%d", &newContact->age) == 1 && newContact->age >= 1 && newContact->age <= 150) break;
-        printf("Error: Invalid age. Try again:\n");
-        while (getchar() != '\n');
-        attempts++;
-    }
-    if (attempts == 5) {
-        printf("Error: Could not read a valid age\n");
-        newContact->age = 0;
-    }
-    while (getchar() != '\n');
-    return newContact;
-}
-
-// Appends contact to the end
-Contact **appendContact(Contact **contacts, Contact *newContact) {
-    if (!newContact) return contacts;
-    int count = countContacts(contacts);
-    Contact **newArray = (Contact **)realloc(contacts, (count + 2) * sizeof(Contact *));
-    if (!newArray) {
-        printf("Memory reallocation error in appendContact\n");
-        return contacts;
-    }
-    newArray[count] = newContact;
-    newArray[count + 1] = NULL;
-    printf("Contact appended successfully by appendContact\n");
-    return newArray;
-}
-
-// Inserts contact alphabetically
-Contact **insertContactAlphabetical(Contact **contacts, Contact *newContact) {
-    if (!newContact) return contacts;
-    int count = countContacts(contacts);
-    Contact **newArray = (Contact **)realloc(contacts, (count + 2) * sizeof(Contact *));
-    if (!newArray) {
-        printf("Memory reallocation error in insertContactAlphabetical\n");
-        return contacts;
-    }
-    int i;
-    for (i = 0; i < count; i++) {
-        int cmp = strcmp(newContact->familyName, newArray[i]->familyName);
-        if (cmp < 0 || (cmp == 0 && strcmp(newContact->firstName, newArray[i]->firstName) < 0)) break;
-    }
-    for (int j = count; j > i; j--) newArray[j] = newArray[j - 1];
-    newArray[i] = newContact;
-    newArray[count + 1] = NULL;
-    printf("Contact was successfully added in alphabetical order\n");
-    return newArray;
-}
-
-// Removes contact by index
-Contact **removeContactByIndex(Contact **contacts) {
-    if (!contacts) {
-        printf("Error: value of addressBook received in removeContactByIndex was NULL\n");
-        return NULL;
-    }
-    int count = countContacts(contacts);
-    if (count == 0) {
-        printf("Error: Index out of range in removeContactByIndex\n");
-        return contacts;
-    }
-    int index;
-    printf("Removing a contact by index\nEnter index to remove (0 based): ");
-    if (scanf("%d", &index) != 1) {
-        printf("Error: Value of index supplied could not be read.\n");
-        while (getchar() != '\n');
-        return contacts;
-    }
-    while (getchar() != '\n');
-    if (index < 0 || index >= count) {
-        printf("Error: Index out of range in removeContactByIndex\n");
-        return contacts;
-    }
-    freeContact(contacts[index]);
-    for (int i = index; i < count; i++) contacts[i] = contacts[i + 1];
-    Contact **newArray = (Contact **)realloc(contacts, (count) * sizeof(Contact *));
-    if (!newArray) {
-        printf("Error: Memory reallocation failed in removeContactByIndex\n");
-        return contacts;
-    }
-    if (count - 1 == 0) newArray[0] = NULL;
-    printf("Contact removed successfully by removeContactByIndex\n");
-    return newArray;
-}
-
-// Removes contact by full name
-int removeContactByFullName(Contact ***contacts) {
-    if (!contacts || !*contacts) {
-        printf("Error: value of contacts received in removeContactByFullName was NULL\n");
-        return 0;
-    }
-    char firstName[256], familyName[256];
-    printf("Enter first name: ");
-    fgets(firstName, sizeof(firstName), stdin);
-    firstName[strcspn(firstName, "\n")] = 0;
-    printf("Enter family name: ");
-    fgets(familyName, sizeof(familyName), stdin);
-    familyName[strcspn(familyName, "\n")] = 0;
-
-    int count = countContacts(*contacts);
-    for (int i = 0; i < count; i++) {
-        if (strcmp((*contacts)[i]->firstName, firstName) == 0 &&
-            strcmp((*contacts)[i]->familyName, familyName) == 0) {
-            freeContact((*contacts)[i]);
-            for (int j = i; j < count; j++) (*contacts)[j] = (*contacts)[j + 1];
-            Contact **newArray = (Contact **)realloc(*contacts, (count) * sizeof(Contact *));
-            if (!newArray) {
-                printf("Error: Memory reallocation failed in removeContactByFullName\n");
-                return 1;
-            }
-            *contacts = newArray;
-            if (count - 1 == 0) (*contacts)[0] = NULL;
-            printf("Contact '%s %s' removed successfully\n", firstName, familyName);
-            return 1;
-        }
-    }
-    printf("Contact '%s %s' not found\n", firstName, familyName);
-    return 2;
-}
-
-// Lists all contacts
-void listContacts(Contact **contacts) {
-    int count = countContacts(contacts);
-    if (count == 0) {
-        printf("No contacts available.\n");
-        return;
-    }
-    for (int i = 0; i < count; i++) {
-        printf("%d. %s %s\n", i + 1, contacts[i]->firstName, contacts[i]->familyName);
-        printf("Phone: %lld\n", contacts[i]->phoneNum);
-        printf("Address: %s\n", contacts[i]->address);
-        printf("Age: %d\n", contacts[i]->age);
-    }
-}
-
-// Saves the contacts to file (input format)
-void saveContactsToFile(Contact **contacts, char *filename) {
-    if (!filename) {
-        printf("Error: filename formal parameter passed value NULL in saveContactsToFile\n");
-        return;
-    }
-    if (!contacts) {
-        printf("Error: addressBook formal parameter passed value NULL in saveContactsToFile\n");
-        return;
-    }
-    FILE *file = fopen(filename, "w");
-    if (!file) {
-        printf("Error: file not opened in saveContactsToFile\n");
-        return;
-    }
-    int count = countContacts(contacts);
-    for (int i = 0; i < count; i++) {
-        fprintf(file, "%s\n%s\n%s\n%lld\n%d\n", contacts[i]->firstName, contacts[i]->familyName,
-                contacts[i]->address, contacts[i]->phoneNum, contacts[i]->age);
-    }
-    fclose(file);
-}
-
-// Print contacts to file (human-readable)
-void printContactsToFile(Contact **contacts, char *filename) {
-    if (!filename) {
-        printf("Error: filename formal parameter passed value NULL in printContactsToFile\n");
-        return;
-    }
-    if (!contacts) {
-        printf("Error: addressBook formal parameter passed value NULL in printContactsToFile\n");
-        return;
-    }
-    FILE *file = fopen(filename, "w");
-    if (!file) {
-        printf("Error: file not opened in printContactsToFile\n");
-        return;
-    }
-    int count = countContacts(contacts);
-    fprintf(file, "Address Book Report\n\n");
-    for (int i = 0; i < count; i++) {
-        fprintf(file, "%d. %s %s\n", i + 1, contacts[i]->firstName, contacts[i]->familyName);
-        fprintf(file, "Phone: %lld\n", contacts[i]->phoneNum);
-        fprintf(file, "Address: %s\n", contacts[i]->address);
-        fprintf(file, "Age: %d\n\n", contacts[i]->age);
-    }
-    fprintf(file, "Total Contacts: %d\n", count);
-    fclose(file);
-}
-
-// Load contacts from file (replace existing)
-Contact **loadContactsFromFile(char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        printf("Error: file not opened in loadContactsFromFile\n");
-        return (Contact **)malloc(sizeof(Contact *));
-    }
-    Contact **newContacts = (Contact **)malloc(sizeof(Contact *));
-    newContacts[0] = NULL;
-    char buffer[256];
-    int count = 0;
-    while (fgets(buffer, sizeof(buffer), file)) {
-        Contact *contact = (Contact *)malloc(sizeof(Contact));
-        buffer[strcspn(buffer, "\n")] = 0;
-        contact->firstName = strdup(buffer);
-        fgets(buffer, sizeof(buffer), file); buffer[strcspn(buffer, "\n")] = 0;
-        contact->familyName = strdup(buffer);
-        fgets(buffer, sizeof(buffer), file); buffer[strcspn(buffer, "\n")] = 0;
-        contact->address = strdup(buffer);
-        fscanf(file, "%lld\n", &contact->phoneNum);
-        fscanf(file, "%d\n", &contact->age);
-        newContacts = (Contact **)realloc(newContacts, (count + 2) * sizeof(Contact *));
-        newContacts[count++] = contact;
-        newContacts[count] = NULL;
-    }
-    fclose(file);
-    return newContacts;
-}
-
-// Appends contacts from file
-Contact **appendContactsFromFile(Contact **contacts, char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        printf("Error: file not opened in appendContactsFromFile\n");
-        return contacts;
-    }
-    char buffer[256];
-    while (fgets(buffer, sizeof(buffer), file)) {
-        Contact *contact = (Contact *)malloc(sizeof(Contact));
-        buffer[strcspn(buffer, "\n")] = 0;
-        contact->firstName = strdup(buffer);
-        fgets(buffer, sizeof(buffer), file); buffer[strcspn(buffer, "\n")] = 0;
-        contact->familyName = strdup(buffer);
-        fgets(buffer, sizeof(buffer), file); buffer[strcspn(buffer, "\n")] = 0;
-        contact->address = strdup(buffer);
-        fscanf(file, "%lld\n", &contact->phoneNum);
-        fscanf(file, "%d\n", &contact->age);
-        if (!isDuplicate(contacts, contact)) {
-            contacts = appendContact(contacts, contact);
-        } else {
-            freeContact(contact);
-        }
-    }
-    fclose(file);
-    return contacts;
-}
-
-// Merges contacts from file
-Contact **mergeContactsFromFile(Contact **contacts, char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        printf("Error: file not opened in mergeContactsFromFile\n");
-        return contacts;
-    }
-    char buffer[256];
-    while (fgets(buffer, sizeof(buffer), file)) {
-        Contact *contact = (Contact *)malloc(sizeof(Contact));
-        buffer[strcspn(buffer, "\n")] = 0;
-        contact->firstName = strdup(buffer);
-        fgets(buffer, sizeof(buffer), file); buffer[strcspn(buffer, "\n")] = 0;
-        contact->familyName = strdup(buffer);
-        fgets(buffer, sizeof(buffer), file); buffer[strcspn(buffer, "\n")] = 0;
-        contact->address = strdup(buffer);
-        fscanf(file, "%lld\n", &contact->phoneNum);
-        fscanf(file, "%d\n", &contact->age);
-        if (!isDuplicate(contacts, contact)) {
-            contacts = insertContactAlphabetical(contacts, contact);
-        } else {
-            freeContact(contact);
-        }
-    }
-    fclose(file);
-    return contacts;
-}
-
-// Edits contact by index
-Contact *editContact(Contact **contacts, int index) {
-    int count = countContacts(contacts);
-    if (index < 0 || index >= count) return NULL;
-    Contact *contact = contacts[index];
-    int choice;
-    char buffer[256];
-    while (1) {
-        printf("1. Edit First Name\n2. Edit Last Name\n3. Edit Address\n4. Edit Phone Number\n5. Edit Age\n6. Cancel\n");
-        printf("Select an option: ");
-        scanf("%d", &choice); 
-        while (getchar() != '\n');
-        switch (choice) {
-            case 1:
-                printf("Enter new first name: ");
-                fgets(buffer, sizeof(buffer), stdin);
-                buffer[strcspn(buffer, "\n")] = 0;
-                free(contact->firstName);
-                contact->firstName = strdup(buffer);
-                break;
-            case 2:
-                printf("Enter new family name: ");
-                fgets(buffer, sizeof(buffer), stdin);
-                buffer[strcspn(buffer, "\n")] = 0;
-                free(contact->familyName);
-                contact->familyName = strdup(buffer);
-                break;
-            case 3:
-                printf("Enter new address: ");
-                fgets(buffer, sizeof(buffer), stdin);
-                buffer[strcspn(buffer, "\n")] = 0;
-                free(contact->address);
-                contact->address = strdup(buffer);
-                break;
-            case 4:
-                printf("Enter new 10-digit phone number: ");
-                scanf("%lld", &contact->phoneNum);
-                while (getchar() != '\n');
-                break;
-            case 5:
-                printf("Enter new age: ");
-                scanf("%d", &contact->age);
-                while (getchar() != '\n');
-                break;
-            case 6:
-                return contact;
-            default:
-                printf("Invalid option.\n");
-        }
-    }
-    return contact;
-}
-
-
-int main() {
-    Contact **addressBook = (Contact **)malloc(sizeof(Contact *));
-    addressBook[0] = NULL;
-    int choice;
-    char filename[256];
-
-    while (1) {
-        printf("\nAddress Book Menu\n");
-        printf("1. Append Contact\n");
-        printf("2. Insert Contact in Alphabetical Order\n");
-        printf("3. Remove Contact by Index\n");
-        printf("4. Remove Contact by Full Name\n");
-        printf("5. Find and Edit Contact\n");
-        printf("6. List Contacts\n");
-        printf("7. Print Contacts to File with the format of an input file\n");
-        printf("8. Print Contacts to File (Human Readable)\n");
-        printf("9. Load Contacts from File Replacing Existing Contacts\n");
-        printf("10. Append Contacts from File\n");
-        printf("11. Merge Contacts from File\n");
-        printf("12. Exit\n");
-        printf("Choose an option: ");
-        scanf("%d", &choice);
-        while (getchar() != '\n');
-
-        switch (choice) {
-            case 1: {
-                Contact *newContact = readNewContact();
-                if (newContact) addressBook = appendContact(addressBook, newContact);
-                break;
-            }
-            case 2: {
-                Contact *newContact = readNewContact();
-                if (newContact) addressBook = insertContactAlphabetical(addressBook, newContact);
-                break;
-            }
-            case 3:
-                addressBook = removeContactByIndex(addressBook);
-                break;
-            case 4:
-                removeContactByFullName(&addressBook);
-                break;
-            case 5: {
-                int index;
-                printf("Enter index to edit (0-based): ");
-                scanf("%d", &index);
-                while (getchar() != '\n');
-                editContact(addressBook, index);
-                break;
-            }
-            case 6:
-                listContacts(addressBook);
-                break;
-            case 7:
-                printf("Enter filename: ");
-                fgets(filename, sizeof(filename), stdin);
-                filename[strcspn(filename, "\n")] = 0;
-                saveContactsToFile(addressBook, filename);
-                break;
-            case 8:
-                printf("Enter filename: ");
-                fgets(filename, sizeof(filename), stdin);
-                filename[strcspn(filename, "\n")] = 0;
-                printContactsToFile(addressBook, filename);
-                break;
-            case 9: {
-                printf("Enter filename: ");
-                fgets(filename, sizeof(filename), stdin);
-                filename[strcspn(filename, "\n")] = 0;
-                int count = countContacts(addressBook);
-                for (int i = 0; i < count; i++) freeContact(addressBook[i]);
-                free(addressBook);
-                addressBook = loadContactsFromFile(filename);
-                break;
-            }
-            case 10:
-                printf("Enter filename: ");
-                fgets(filename, sizeof(filename), stdin);
-                filename[strcspn(filename, "\n")] = 0;
-                addressBook = appendContactsFromFile(addressBook, filename);
-                break;
-            case 11:
-                printf("Enter filename: ");
-                fgets(filename, sizeof(filename), stdin);
-                filename[strcspn(filename, "\n")] = 0;
-                addressBook = mergeContactsFromFile(addressBook, filename);
-                break;
-            case 12: {
-                int count = countContacts(addressBook);
-                for (int i = 0; i < count; i++) freeContact(addressBook[i]);
-                free(addressBook);
-                return 0;
-            }
-            default:
-                printf("Invalid option. Please try again.\n");
-        }
-    }
-    return 0;
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Contact structure definition
+typedef struct Contact {
+    char *firstName;
+    char *familyName;
+    long long phoneNum; // 10-digit phone number as 64-bit integer
+    char *address;
+    int age;
+    unsigned int addressNumber; // compact storage: house number split off the front of address, 0 for none
+} Contact;
+
+// Slot in a contact hash index (open addressing, linear probing)
+typedef struct HashIndexEntry {
+    unsigned long long hash;
+    Contact *contact; // NULL for an empty slot, HASH_INDEX_TOMBSTONE for a deleted one
+} HashIndexEntry;
+
+// Hash index of contacts by some key (full name, phone number), may hold several
+// contacts with the same key; lookups compare the key fields of the contacts themselves
+typedef struct HashIndex {
+    HashIndexEntry *entries;
+    size_t capacity; // always a power of two (or 0 before the first insert)
+    size_t size;     // live entries
+    size_t used;     // live entries plus tombstones
+} HashIndex;
+
+// Contacts kept sorted by one name ordering for prefix queries. While stale the array
+// is not maintained and the next query rebuilds it, so bulk operations skip the per-insert shifting.
+typedef struct SortedIndex {
+    Contact **items;
+    int count;
+    int capacity;
+    int stale;
+    int (*compare)(const Contact *, const Contact *);
+    int (*comparePointers)(const void *, const void *); // the same ordering, for qsort
+    const char *(*key)(const Contact *);                // the field prefixes are matched against
+} SortedIndex;
+
+#define ORDER_NODE_SIZE 64                       // contacts in a leaf, children of an inner node
+#define ORDER_NODE_FILL (ORDER_NODE_SIZE * 3 / 4) // built nodes are this full, shrinking ones merge below it
+
+// Node of a counted B+tree holding contacts in book order. Every node knows how many
+// contacts are below it (to find positions) and the first of them (to find names).
+typedef struct OrderNode {
+    int leaf;
+    int count;       // contacts of a leaf, children of an inner node
+    int total;       // contacts in the subtree
+    Contact *first;  // first of them in book order
+    union {
+        Contact *contacts[ORDER_NODE_SIZE];
+        struct OrderNode *children[ORDER_NODE_SIZE];
+    };
+} OrderNode;
+
+// Book order as a tree, so single contacts are inserted and removed in the middle of a
+// large book in O(log n). Bulk operations work on the contacts vector and drop the tree,
+// which the next single-contact change rebuilds.
+typedef struct ContactOrder {
+    OrderNode *root; // NULL while stale
+    int stale;
+    int sorted;      // the book is in alphabetical order: 1 yes, 0 no, -1 not checked since it changed
+} ContactOrder;
+
+// Block of bump-allocated memory, blocks are chained and only freed all at once
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+// Bump allocator holding every contact record and string of a book
+typedef struct Arena {
+    ArenaBlock *blocks;
+} Arena;
+
+// Slot in a string pool
+typedef struct StringPoolEntry {
+    unsigned long long hash;
+    const char *text; // NULL for an empty slot
+} StringPoolEntry;
+
+// Distinct strings. With compact storage (ADDRESSBOOK_COMPACT) contacts point to the pooled
+// copy, so a name or street shared by many contacts is stored once.
+typedef struct StringPool {
+    StringPoolEntry *entries;
+    size_t capacity; // always a power of two (or 0 before the first insert)
+    size_t size;
+    Arena text;      // the strings, apart from the contacts so the ones in use stay close together
+} StringPool;
+
+// File mapping whose bytes are referenced by contacts (binary snapshots), unmapped with the book
+typedef struct MappedFile {
+    struct MappedFile *next;
+    void *data;
+    size_t size;
+} MappedFile;
+
+// When journal records reach the disk
+enum {
+    JOURNAL_FSYNC_ALWAYS, // every record is written and synced before the mutation returns
+    JOURNAL_FSYNC_BATCH,  // records are buffered, then written and synced once per menu operation
+    JOURNAL_FSYNC_NEVER   // buffered like BATCH but syncing is left to the OS
+};
+
+#define JOURNAL_BUFFER_SIZE (1 << 16)
+
+// Append-only write-ahead log of mutations applied on top of a base text file
+typedef struct Journal {
+    int fd;
+    char *basePath;
+    char *journalPath; // basePath + ".journal"
+    int fsyncPolicy;
+    char *buffer; // encoded records not written yet
+    size_t length;
+    size_t capacity;
+    long long records; // records in the journal file since the last compaction
+} Journal;
+
+// Contact fields, numbered like the options of the edit menu
+enum {
+    CONTACT_FIELD_FIRST_NAME = 1,
+    CONTACT_FIELD_FAMILY_NAME,
+    CONTACT_FIELD_ADDRESS,
+    CONTACT_FIELD_PHONE,
+    CONTACT_FIELD_AGE
+};
+
+// Growable list of contacts produced by the file loader
+typedef struct ContactBatch {
+    Contact **items;
+    int count;
+    int capacity;
+} ContactBatch;
+
+#define PARSE_REPORT_LINES 10 // fields listed by line number, the others only counted
+
+// Phone numbers and ages of an input file that are not valid, see parseContactRecords: records
+// skipped because a field is not a number, and fields loaded although they are out of range
+typedef struct ParseReport {
+    long long line;        // number of the next line to parse, advanced by parseContactRecords
+    long long malformed;   // records skipped
+    long long outOfRange;  // fields loaded as they are
+    long long lines[PARSE_REPORT_LINES];  // line of the field, for the first ones noted
+    int fields[PARSE_REPORT_LINES];       // CONTACT_FIELD_PHONE or CONTACT_FIELD_AGE
+    int skipped[PARSE_REPORT_LINES];      // 1 when the record was skipped, 0 when it was loaded
+} ParseReport;
+
+// Finds the newlines of a buffer one after the other, 64 bytes per SSE2 scan
+typedef struct LineScanner {
+    const char *next; // first byte not scanned yet
+    const char *end;
+    const char *base; // byte of bit 0 of mask
+    uint64_t mask;    // newlines scanned but not returned yet
+} LineScanner;
+
+// Column-oriented copy of the book for filter scans: one entry per contact in book order,
+// rebuilt from the vector when stale. Ages outside 0..255 cannot be stored in the age column,
+// queries fall back to the contacts themselves while the book has any.
+typedef struct ContactColumns {
+    int count;
+    int stale;
+    int ageOutliers;
+    uint8_t *ages;
+    int64_t *phones;
+    uint32_t *familyOffsets; // into familyHeap, NUL-terminated family names
+    char *familyHeap;
+    Contact **contacts;      // the contact of each row, for results
+} ContactColumns;
+
+// Conditions of a filter query, all inclusive; the widest bounds (INT_MIN..INT_MAX,
+// LLONG_MIN..LLONG_MAX) and an empty prefix leave a condition out
+typedef struct ContactFilter {
+    int minAge;
+    int maxAge;
+    long long minPhone;
+    long long maxPhone;
+    const char *familyPrefix;
+} ContactFilter;
+
+// Summary of the contacts that passed a filter
+typedef struct ContactAggregate {
+    long long count;
+    long long ageSum;
+    int minAge;
+    int maxAge;
+} ContactAggregate;
+
+// Text keys fuzzy search can match against
+enum {
+    FUZZY_FULL_NAME,   // first name, a space, family name
+    FUZZY_FIRST_NAME,
+    FUZZY_FAMILY_NAME,
+    FUZZY_ADDRESS,
+    FUZZY_KEY_COUNT
+};
+
+#define FUZZY_GRAM_BITS 18 // a trigram is three 6-bit character codes
+#define FUZZY_GRAMS (1 << FUZZY_GRAM_BITS)
+
+// Trigram inverted index over one fuzzy key of every contact, in book order and rebuilt
+// when stale like the columns. Keys are folded to lower case and padded with code 0 at both
+// ends, so a key of n characters has n trigrams; each row is listed once per distinct trigram.
+typedef struct FuzzyIndex {
+    int count;
+    int stale;
+    uint32_t *offsets;  // FUZZY_GRAMS + 1 entries: rows of gram g are postings[offsets[g]..offsets[g + 1])
+    uint32_t *postings; // rows, ascending for each gram
+    uint8_t *hits;      // per row, counts postings a query found it in; zero between queries
+} FuzzyIndex;
+
+// A contact found by fuzzy search with its edit distance to the query
+typedef struct FuzzyMatch {
+    Contact *contact;
+    int distance;
+    int position; // in the book (or view), ties rank in book order
+} FuzzyMatch;
+
+// A fuzzy search in progress: the folded query, its match masks and the matches so far
+typedef struct FuzzyQuery {
+    int key;
+    int maxDistance;
+    char *text;
+    int length;
+    uint64_t peq[256]; // for queries of up to 64 characters
+    int *row;          // DP row for longer ones
+    char *buffer;      // folded key of the contact being checked
+    size_t capacity;
+    FuzzyMatch *matches;
+    int count;
+    int matchCapacity;
+} FuzzyQuery;
+
+// Share of a parallel fuzzy scan: the rows first..first + count - 1 checked with a private query
+typedef struct FuzzyScanChunk {
+    FuzzyQuery query;
+    Contact **contacts;
+    int first;
+    int count;
+    int ok;
+} FuzzyScanChunk;
+
+// Address book: contacts vector with explicit length and capacity plus the name index kept in sync with it
+typedef struct AddressBook {
+    Contact **contacts;
+    int count;
+    int capacity;
+    HashIndex names;           // by (firstName, familyName)
+    HashIndex phones;          // by phoneNum
+    int hashesStale;           // names and phones are built on first use (after a snapshot load), see bookNames
+    SortedIndex byFamilyName;  // by (familyName, firstName), for family-name prefixes
+    SortedIndex byFirstName;   // by (firstName, familyName), for first-name prefixes
+    ContactOrder order;        // the same sequence as contacts, for single inserts and removals
+    int contactsStale;         // the tree has changes the vector lacks, see bookContacts
+    ContactColumns columns;    // for age, phone and family-name filter scans
+    FuzzyIndex fuzzy[FUZZY_KEY_COUNT]; // trigram indexes for fuzzy search, built on first use
+    Arena storage; // owns every Contact in the book and its strings, freed in one go
+    int compact;          // compact storage: new contacts share pooled strings, see storeAddress
+    StringPool strings;   // the pool; its strings join storage when the book is freed
+    MappedFile *mappings; // snapshots whose string heaps contacts still point into
+    Journal *journal;     // NULL unless mutations are being logged
+    struct StoragePin *pin; // set once views of the book were published, see freeAddressBook
+} AddressBook;
+
+// Arena and mappings that published views may still point into. The book owns them until it
+// is freed or replaced, then hands them over here and the last reference frees them.
+typedef struct StoragePin {
+    atomic_int refs; // one for the book while it owns the storage, one per view
+    Arena arena;
+    MappedFile *mappings;
+} StoragePin;
+
+// Immutable copy of the contacts vector published for readers. Contacts are never changed
+// in place once in a book (edits copy them), so a view stays consistent while writers go on.
+typedef struct BookView {
+    Contact **contacts;
+    int count;
+    long long generation; // views of the book published before this one, plus one
+    atomic_int refs; // one for the SharedBook while it is the current view, one per reader
+    StoragePin *pin;
+} BookView;
+
+// Address book shared between threads. Writers take writeLock, change the book and publish
+// a new view; readers take the current view and never wait for a writer (viewLock is only
+// held to swap or reference the view pointer).
+typedef struct SharedBook {
+    AddressBook book;
+    pthread_mutex_t writeLock;
+    pthread_mutex_t viewLock;
+    BookView *view;
+    long long generation; // of the current view
+} SharedBook;
+
+// Append or merge from file running on its own thread against a SharedBook
+typedef struct BackgroundImport {
+    SharedBook *shared;
+    char filename[256];
+    int merge;
+    pthread_t thread;
+    int running; // started and not joined yet
+} BackgroundImport;
+
+enum { SAVE_CONTACTS, SAVE_REPORT, SAVE_SNAPSHOT };
+
+// File to write from a view of the book, see BackgroundSaver
+typedef struct SaveJob {
+    struct SaveJob *next;
+    BookView *view;
+    int kind;           // SAVE_CONTACTS, SAVE_REPORT or SAVE_SNAPSHOT
+    char filename[256];
+} SaveJob;
+
+// Thread writing the saves the menu queues, and the periodic autosave, so the menu only
+// waits to take a view of the book. Jobs are written one at a time in the order queued.
+typedef struct BackgroundSaver {
+    SharedBook *shared;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;  // a job was queued or written, or the settings changed
+    SaveJob *first;
+    SaveJob *last;
+    int writing;             // a job taken off the queue is being written
+    int stopping;
+    int autosaveSeconds;     // 0 for no autosave
+    char autosaveFile[256];
+    long long autosaved;     // generation of the view autosaved last
+    struct timespec nextAutosave;
+    pthread_t thread;
+    int running;             // started and not joined yet
+} BackgroundSaver;
+
+// Worker threads (file import, output formatting) default to one per online CPU,
+// ADDRESSBOOK_THREADS overrides it; files are only split while every import thread
+// gets at least IMPORT_MIN_CHUNK bytes
+#define WORKER_MAX_THREADS 64
+#define IMPORT_MIN_CHUNK (1 << 20)
+
+// Slice of an input file handled by one import thread
+typedef struct ImportChunk {
+    const char *begin;
+    const char *end;
+    size_t lines;           // newlines in the slice, from the counting pass
+    Arena arena;            // contacts parsed from the slice, adopted by the book afterwards
+    ContactBatch batch;
+    AddressBook *existing;  // contacts already in this book are dropped, or NULL
+    StringPool *strings;    // compact storage: pool for the slice's strings, or NULL
+    StringPool pool;        // the slice's own pool when several threads parse
+    ParseReport report;     // records of the slice skipped as malformed
+    int ok;
+} ImportChunk;
+
+// Text layouts written by writeContacts
+enum {
+    CONTACT_FORMAT_SAVE,   // the input file format
+    CONTACT_FORMAT_LIST,   // numbered listing
+    CONTACT_FORMAT_REPORT  // numbered listing with a blank line after each contact
+};
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define OUTPUT_PARALLEL_CHUNK 16384 // contacts one thread formats per round
+
+// Output built in memory and handed to the file descriptor with one write() per full buffer;
+// with fd -1 the buffer only collects (grows) until its owner writes it out
+typedef struct OutBuf {
+    int fd;
+    char *data;
+    size_t length;
+    size_t capacity;
+    int failed; // a write or an allocation failed, later output is dropped
+} OutBuf;
+
+// Run of contacts formatted by one output thread
+typedef struct FormatChunk {
+    Contact **contacts;
+    int count;
+    int firstNumber; // listing number of contacts[0]
+    int format;
+    OutBuf out;
+} FormatChunk;
+
+// Batch script commands that are queued and applied together, see runCommandScript
+enum {
+    SCRIPT_NONE,
+    SCRIPT_ADD,
+    SCRIPT_INSERT,
+    SCRIPT_REMOVE,
+    SCRIPT_EDIT
+};
+
+// Contact and its position in the book (or in a batch)
+typedef struct ContactPosition {
+    Contact *contact;
+    int position;
+} ContactPosition;
+
+// Open-addressing map from contacts to their positions in the book
+typedef struct PositionTable {
+    ContactPosition *entries; // contact NULL for an empty slot
+    size_t capacity;          // a power of two, at least twice the size
+    size_t size;
+} PositionTable;
+
+// Queued remove-by-name command; the key comes first so hits in an index of keys map back to it
+typedef struct ScriptRemoval {
+    Contact key;   // only the names are set
+    int line;
+    int remaining; // contacts of this name still to be removed, repeated commands are folded in
+} ScriptRemoval;
+
+// Commands of a script run that are waiting to be applied together
+typedef struct ScriptState {
+    AddressBook *book;
+    Arena scratch;            // removal keys and file names, freed with the script
+    int kind;                 // SCRIPT_ADD, SCRIPT_INSERT or SCRIPT_REMOVE queued in pending
+    ContactBatch pending;     // new contacts, or removal keys
+    PositionTable positions;  // book positions of contacts, built for a run of edits
+    int commands;
+    int failed;
+} ScriptState;
+
+// Streaming merge of files larger than memory (mergeFilesStreaming): sorted runs written so
+// far, in the order their records rank among equal names
+typedef struct StreamMerge {
+    const char *outputFile; // runs are created next to it by createTempFile
+    size_t memoryLimit;
+    char **runs;
+    int runCount;
+    int runCapacity;
+    int bookRuns;           // the first bookRuns runs hold the book's records, all of which are kept
+} StreamMerge;
+
+// A sorted run read back during the merge. The current record's fields point into buffer,
+// which holds whole records and grows for records longer than it.
+typedef struct RunReader {
+    int fd;
+    int rank;      // runs made earlier win among equal names
+    char *buffer;
+    size_t capacity;
+    size_t start;  // of the next record
+    size_t length;
+    int eof;
+    Contact current;
+} RunReader;
+
+// Synthetic contacts written by generateContacts (--generate and --bench). Record n of a
+// seed is always the same, so a second file can continue the first from first = count.
+typedef struct GeneratorOptions {
+    long long first;       // number of the first record
+    long long count;
+    int collisionPercent;  // records that repeat the full name of an earlier record
+    int nameLength;        // mean length of first and family names
+    int addressLength;     // mean length of addresses
+    unsigned long long seed;
+} GeneratorOptions;
+
+#define GENERATOR_MAX_LENGTH 200 // longest mean field length accepted
+#define BENCH_MAX_SAMPLES 1000
+
+// Timings of one benchmarked operation at one book size
+typedef struct BenchResult {
+    const char *operation;
+    int contacts;      // book size
+    long long items;   // contacts or operations handled by each sample, for the throughput
+    int count;
+    double seconds[BENCH_MAX_SAMPLES];
+    long peakRssKb;
+    double recall;     // share of the results of a scan the operation also found, -1 when not checked
+} BenchResult;
+
+// Binary snapshot layout: header, count fixed-size records, then a heap of NUL-terminated
+// strings. Integers are stored in host byte order; bump the version whenever the layout
+// or hashFullName changes.
+#define SNAPSHOT_MAGIC "ABOOKSNP"
+#define SNAPSHOT_VERSION 1
+
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t count;
+    uint64_t heapSize;
+    uint64_t recordsChecksum;
+    uint64_t heapChecksum;
+    uint64_t headerChecksum; // over every field above
+} SnapshotHeader;
+
+typedef struct SnapshotRecord {
+    uint64_t nameHash; // hashFullName(firstName, familyName), so loading never touches the heap
+    uint64_t firstNameOffset;
+    uint64_t familyNameOffset;
+    uint64_t addressOffset;
+    int64_t phoneNum;
+    int32_t age;
+    int32_t reserved;
+} SnapshotRecord;
+
+// Counters and latency histograms of the core functions, shown by menu option 24 or at exit
+// (ADDRESSBOOK_METRICS=text or json). Building with -DADDRESSBOOK_NO_METRICS removes them.
+enum {
+    METRIC_INSERTS,
+    METRIC_DELETES,
+    METRIC_VECTOR_GROWTHS,
+    METRIC_HASH_RESIZES,
+    METRIC_ARENA_BLOCKS,
+    METRIC_ARENA_BYTES,
+    METRIC_OUTPUT_GROWTHS,
+    METRIC_DUPLICATE_CHECKS,
+    METRIC_DUPLICATES_FOUND,
+    METRIC_BYTES_PARSED,
+    METRIC_RECORDS_PARSED,
+    METRIC_BYTES_WRITTEN,
+    METRIC_WRITE_CALLS,
+    METRIC_SORTED_INDEX_REBUILDS,
+    METRIC_ORDER_BUILDS,
+    METRIC_COLUMN_BUILDS,
+    METRIC_FUZZY_INDEX_BUILDS,
+    METRIC_FUZZY_ROWS_CHECKED,
+    METRIC_JOURNAL_RECORDS,
+    METRIC_FSYNCS,
+    METRIC_VIEWS_PUBLISHED,
+    METRIC_STREAM_RUNS,
+    METRIC_STRINGS_SHARED,
+    METRIC_COUNTER_COUNT
+};
+
+enum {
+    METRIC_LOAD,
+    METRIC_APPEND,
+    METRIC_MERGE,
+    METRIC_DUPLICATE_SCAN, // dropping known names from a file before append or merge
+    METRIC_PARSE,
+    METRIC_SAVE,
+    METRIC_PRINT,
+    METRIC_LIST,
+    METRIC_INSERT_ALPHABETICAL,
+    METRIC_REMOVE,
+    METRIC_EDIT,
+    METRIC_FIND_PHONE,
+    METRIC_FIND_PREFIX,
+    METRIC_FILTER,
+    METRIC_FUZZY_SEARCH,
+    METRIC_SNAPSHOT_SAVE,
+    METRIC_SNAPSHOT_LOAD,
+    METRIC_JOURNAL_COMMIT,
+    METRIC_SCRIPT,
+    METRIC_STREAM_MERGE,
+    METRIC_SAVE_QUEUE, // the menu handing a save to the saver thread
+    METRIC_LATENCY_COUNT
+};
+
+#define METRIC_BUCKETS 40 // bucket i counts times of 2^i to 2^(i+1) - 1 ns
+
+typedef struct LatencyHistogram {
+    atomic_ullong buckets[METRIC_BUCKETS];
+    atomic_ullong count;
+    atomic_ullong totalNs;
+    atomic_ullong maxNs;
+} LatencyHistogram;
+
+typedef struct Metrics {
+    atomic_ullong counters[METRIC_COUNTER_COUNT];
+    LatencyHistogram latencies[METRIC_LATENCY_COUNT];
+} Metrics;
+
+#ifndef ADDRESSBOOK_NO_METRICS
+#define METRIC_ADD(counter, amount) \
+    atomic_fetch_add_explicit(&metrics.counters[counter], (unsigned long long)(amount), memory_order_relaxed)
+#define METRIC_TIMER(name) struct timespec name; clock_gettime(CLOCK_MONOTONIC, &name)
+#define METRIC_TIME(latency, timer) metricRecordSince(latency, &timer)
+#else
+#define METRIC_ADD(counter, amount) ((void)(amount))
+#define METRIC_TIMER(name) ((void)0)
+#define METRIC_TIME(latency, timer) ((void)0)
+#endif
+
+// Function prototypes
+int countContacts(AddressBook *book);
+Contact **bookContacts(AddressBook *book);
+Contact *readNewContact(AddressBook *book);
+int parsePhoneDigits(const char *text, size_t length, long long *value);
+int parseAgeDigits(const char *text, size_t length, long long *value);
+int appendContact(AddressBook *book, Contact *newContact);
+int insertContactAlphabetical(AddressBook *book, Contact *newContact);
+int removeContactByIndex(AddressBook *book);
+int removeContactByFullName(AddressBook *book);
+int removeContactByName(AddressBook *book, const char *firstName, const char *familyName);
+void listContacts(AddressBook *book);
+int saveContactsToFile(AddressBook *book, char *filename);
+void printContactsToFile(AddressBook *book, char *filename);
+int loadContactsFromFile(AddressBook *book, char *filename);
+int appendContactsFromFile(AddressBook *book, char *filename);
+int mergeContactsFromFile(AddressBook *book, char *filename);
+int saveSnapshotToFile(AddressBook *book, char *filename);
+int findContactsByPhone(AddressBook *book, long long phoneNum, ContactBatch *results);
+int findContactsByPrefix(AddressBook *book, const char *prefix, int byFirstName, ContactBatch *results);
+int findContactsByFilter(AddressBook *book, const ContactFilter *filter, ContactBatch *results,
+                         ContactAggregate *aggregate);
+int findContactsFuzzy(AddressBook *book, int key, const char *text, int maxDistance, int limit, FuzzyMatch *matches);
+void markScanIndexesStale(AddressBook *book);
+void fuzzyIndexFree(FuzzyIndex *index);
+int workerThreadCount(void);
+void runWorkers(void *tasks, size_t taskSize, int count, void *(*work)(void *));
+int loadSnapshotFromFile(AddressBook *book, char *filename);
+Contact *editContact(AddressBook *book, int index);
+int journalCommit(Journal *journal);
+int journalInsert(Journal *journal, int position, Contact *contact);
+int journalDelete(Journal *journal, int position);
+int journalEdit(Journal *journal, int index, Contact *contact);
+int journalMerge(Journal *journal, Contact **batch, int batchCount);
+Journal *openJournal(AddressBook *book, char *basePath, int fsyncPolicy);
+void closeJournal(Journal *journal);
+int compactJournal(AddressBook *book);
+int runCommandScript(AddressBook *book, char *filename);
+long long mergeFilesStreaming(char *bookFile, char *inputFile, char *outputFile, size_t memoryLimit);
+int publishBookView(SharedBook *shared);
+void releaseBookView(BookView *view);
+void finishBackgroundImport(BackgroundImport *job);
+
+const char *metricCounterNames[METRIC_COUNTER_COUNT] = {
+    "inserts", "deletes", "vectorGrowths", "hashResizes", "arenaBlocks", "arenaBytes", "outputGrowths",
+    "duplicateChecks", "duplicatesFound", "bytesParsed", "recordsParsed", "bytesWritten", "writeCalls",
+    "sortedIndexRebuilds", "orderBuilds", "columnBuilds", "fuzzyIndexBuilds", "fuzzyRowsChecked", "journalRecords", "fsyncs",
+    "viewsPublished", "streamRuns", "stringsShared"};
+
+const char *metricLatencyNames[METRIC_LATENCY_COUNT] = {
+    "load", "append", "merge", "duplicateScan", "parse", "save", "print", "list", "insertAlphabetical",
+    "remove", "edit", "findPhone", "findPrefix", "filter", "fuzzySearch", "snapshotSave", "snapshotLoad",
+    "journalCommit", "script", "streamMerge", "saveQueue"};
+
+#ifndef ADDRESSBOOK_NO_METRICS
+Metrics metrics;
+
+// Adds the time since started to a latency histogram; callable from any thread
+void metricRecordSince(int latency, const struct timespec *started) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long elapsed = (now.tv_sec - started->tv_sec) * 1000000000LL + (now.tv_nsec - started->tv_nsec);
+    unsigned long long ns = elapsed > 0 ? (unsigned long long)elapsed : 0;
+    int bucket = 0;
+    while (bucket < METRIC_BUCKETS - 1 && (ns >> (bucket + 1)) != 0) bucket++;
+    LatencyHistogram *histogram = &metrics.latencies[latency];
+    atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->totalNs, ns, memory_order_relaxed);
+    unsigned long long max = atomic_load_explicit(&histogram->maxNs, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&histogram->maxNs, &max, ns, memory_order_relaxed,
+                                                              memory_order_relaxed)) {
+    }
+}
+
+// Upper bound in seconds of the time under which percent of the recorded calls finished
+double metricPercentile(LatencyHistogram *histogram, unsigned long long count, int percent) {
+    unsigned long long rank = (count * percent + 99) / 100;
+    unsigned long long seen = 0;
+    unsigned long long max = atomic_load(&histogram->maxNs);
+    for (int i = 0; i < METRIC_BUCKETS; i++) {
+        seen += atomic_load(&histogram->buckets[i]);
+        if (seen >= rank) {
+            unsigned long long bound = (1ULL << (i + 1)) - 1;
+            return (bound < max ? bound : max) / 1e9;
+        }
+    }
+    return max / 1e9;
+}
+#endif
+
+// Writes the counters and the latencies of the functions called so far, as text or as JSON
+void dumpMetrics(FILE *out, int json) {
+#ifndef ADDRESSBOOK_NO_METRICS
+    fprintf(out, json ? "{\n  \"counters\": {" : "Counters\n");
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        unsigned long long value = atomic_load(&metrics.counters[i]);
+        if (json) fprintf(out, "%s\n    \"%s\": %llu", i ? "," : "", metricCounterNames[i], value);
+        else fprintf(out, "  %-20s %llu\n", metricCounterNames[i], value);
+    }
+    fprintf(out, json ? "\n  },\n  \"latencies\": {" : "Latencies (calls, total ms, mean, p50, p99 and max in us)\n");
+    int listed = 0;
+    for (int i = 0; i < METRIC_LATENCY_COUNT; i++) {
+        LatencyHistogram *histogram = &metrics.latencies[i];
+        unsigned long long count = atomic_load(&histogram->count);
+        if (count == 0) continue;
+        double total = atomic_load(&histogram->totalNs) / 1e9;
+        double max = atomic_load(&histogram->maxNs) / 1e9;
+        double p50 = metricPercentile(histogram, count, 50);
+        double p90 = metricPercentile(histogram, count, 90);
+        double p99 = metricPercentile(histogram, count, 99);
+        if (json) {
+            fprintf(out, "%s\n    \"%s\": {\"count\": %llu, \"totalSeconds\": %.9f, \"meanSeconds\": %.9f, "
+                    "\"p50Seconds\": %.9f, \"p90Seconds\": %.9f, \"p99Seconds\": %.9f, \"maxSeconds\": %.9f, "
+                    "\"buckets\": [",
+                    listed ? "," : "", metricLatencyNames[i], count, total, total / count, p50, p90, p99, max);
+            for (int b = 0; b < METRIC_BUCKETS; b++) {
+                fprintf(out, "%s%llu", b ? ", " : "", atomic_load(&histogram->buckets[b]));
+            }
+            fprintf(out, "]}");
+        } else {
+            fprintf(out, "  %-20s %llu calls, %.3f ms, %.1f / %.1f / %.1f / %.1f us\n", metricLatencyNames[i], count,
+                    total * 1e3, total / count * 1e6, p50 * 1e6, p99 * 1e6, max * 1e6);
+        }
+        listed++;
+    }
+    if (json) fprintf(out, "\n  }\n}\n");
+    else if (listed == 0) fprintf(out, "  none recorded yet\n");
+#else
+    if (json) fprintf(out, "{}\n");
+    else fprintf(out, "Metrics were left out of this build (ADDRESSBOOK_NO_METRICS)\n");
+#endif
+    fflush(out);
+}
+
+// With ADDRESSBOOK_METRICS set to text or json the metrics go to stderr when the program exits
+void dumpMetricsAtExit(void) {
+    const char *setting = getenv("ADDRESSBOOK_METRICS");
+    if (setting) dumpMetrics(stderr, strcmp(setting, "json") == 0);
+}
+
+#define HASH_INDEX_TOMBSTONE ((Contact *)1)
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+// Returns size bytes aligned to align (a power of two) from the arena, adding a block when
+// the current one is full
+void *arenaAllocAligned(Arena *arena, size_t size, size_t align) {
+    ArenaBlock *block = arena->blocks;
+    if (block) block->used = (block->used + align - 1) & ~(align - 1);
+    if (!block || block->used > block->size || block->size - block->used < size) {
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + blockSize);
+        if (!block) {
+            printf("Error: Memory allocation failed in arenaAlloc\n");
+            return NULL;
+        }
+        block->next = arena->blocks;
+        block->used = 0;
+        block->size = blockSize;
+        arena->blocks = block;
+        METRIC_ADD(METRIC_ARENA_BLOCKS, 1);
+        METRIC_ADD(METRIC_ARENA_BYTES, blockSize);
+    }
+    void *result = block->data + block->used;
+    block->used += size;
+    return result;
+}
+
+// Returns size bytes (8-byte aligned) from the arena
+void *arenaAlloc(Arena *arena, size_t size) {
+    return arenaAllocAligned(arena, (size + 7) & ~(size_t)7, 8);
+}
+
+// Copies length bytes into the arena as a NUL-terminated string
+char *arenaStrndup(Arena *arena, const char *text, size_t length) {
+    char *copy = (char *)arenaAlloc(arena, length + 1);
+    if (!copy) return NULL;
+    memcpy(copy, text, length);
+    copy[length] = 0;
+    return copy;
+}
+
+// Moves every block of from into arena, behind its current block so allocation continues there
+void arenaAdopt(Arena *arena, Arena *from) {
+    ArenaBlock *last = from->blocks;
+    if (!last) return;
+    while (last->next) last = last->next;
+    if (arena->blocks) {
+        last->next = arena->blocks->next;
+        arena->blocks->next = from->blocks;
+    } else {
+        arena->blocks = from->blocks;
+    }
+    from->blocks = NULL;
+}
+
+// Releases every block of the arena
+void arenaFree(Arena *arena) {
+    ArenaBlock *block = arena->blocks;
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+}
+
+// FNV-1a of length bytes
+unsigned long long hashText(const char *text, size_t length) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Places a string in a table known to have room
+void stringPoolPlace(StringPoolEntry *entries, size_t capacity, unsigned long long hash, const char *text) {
+    size_t mask = capacity - 1;
+    size_t i = (size_t)hash & mask;
+    while (entries[i].text != NULL) i = (i + 1) & mask;
+    entries[i].hash = hash;
+    entries[i].text = text;
+}
+
+// Makes room for one more string (load factor kept under 1/2)
+int stringPoolReserve(StringPool *pool) {
+    if ((pool->size + 1) * 2 <= pool->capacity) return 1;
+    size_t capacity = pool->capacity ? pool->capacity * 2 : 1024;
+    StringPoolEntry *entries = (StringPoolEntry *)calloc(capacity, sizeof(StringPoolEntry));
+    if (!entries) {
+        printf("Error: Memory allocation failed in stringPoolReserve\n");
+        return 0;
+    }
+    for (size_t i = 0; i < pool->capacity; i++) {
+        if (pool->entries[i].text) stringPoolPlace(entries, capacity, pool->entries[i].hash, pool->entries[i].text);
+    }
+    free(pool->entries);
+    pool->entries = entries;
+    pool->capacity = capacity;
+    return 1;
+}
+
+// The pooled copy of length bytes of text, added to the pool first if it has none
+char *stringPoolIntern(StringPool *pool, const char *text, size_t length) {
+    if (!stringPoolReserve(pool)) return NULL;
+    unsigned long long hash = hashText(text, length);
+    size_t mask = pool->capacity - 1;
+    size_t i = (size_t)hash & mask;
+    for (; pool->entries[i].text != NULL; i = (i + 1) & mask) {
+        const char *pooled = pool->entries[i].text;
+        if (pool->entries[i].hash == hash && strncmp(pooled, text, length) == 0 && pooled[length] == '\0') {
+            METRIC_ADD(METRIC_STRINGS_SHARED, 1);
+            return (char *)pooled;
+        }
+    }
+    // Packed without padding, the pool only holds strings
+    char *copy = (char *)arenaAllocAligned(&pool->text, length + 1, 1);
+    if (!copy) return NULL;
+    memcpy(copy, text, length);
+    copy[length] = 0;
+    pool->entries[i].hash = hash;
+    pool->entries[i].text = copy;
+    pool->size++;
+    return copy;
+}
+
+// Takes over the strings of from, adding the ones pool does not have yet to its table
+void stringPoolAdopt(StringPool *pool, StringPool *from) {
+    arenaAdopt(&pool->text, &from->text);
+    for (size_t i = 0; i < from->capacity; i++) {
+        const char *text = from->entries[i].text;
+        if (!text) continue;
+        unsigned long long hash = from->entries[i].hash;
+        if (!stringPoolReserve(pool)) return;
+        size_t mask = pool->capacity - 1;
+        size_t j = (size_t)hash & mask;
+        while (pool->entries[j].text != NULL &&
+               (pool->entries[j].hash != hash || strcmp(pool->entries[j].text, text) != 0)) j = (j + 1) & mask;
+        if (pool->entries[j].text == NULL) {
+            pool->entries[j].hash = hash;
+            pool->entries[j].text = text;
+            pool->size++;
+        }
+    }
+}
+
+void stringPoolFree(StringPool *pool) {
+    free(pool->entries);
+    pool->entries = NULL;
+    pool->capacity = pool->size = 0;
+    arenaFree(&pool->text);
+}
+
+// Stores a string field of a new contact: copied into arena, or with a pool (compact storage)
+// shared with every equal field
+char *storeString(Arena *arena, StringPool *pool, const char *text, size_t length) {
+    return pool ? stringPoolIntern(pool, text, length) : arenaStrndup(arena, text, length);
+}
+
+// Stores the address of a new contact. With a pool a leading house number (up to 9 digits
+// without a leading zero, then a space) goes to addressNumber and only the street and city
+// after it are stored, pooled, since that part is what contacts share.
+int storeAddress(Arena *arena, StringPool *pool, Contact *contact, const char *text, size_t length) {
+    size_t digits = 0;
+    unsigned int number = 0;
+    if (pool && length > 0 && text[0] >= '1' && text[0] <= '9') {
+        while (digits < length && digits < 9 && text[digits] >= '0' && text[digits] <= '9') {
+            number = number * 10 + (unsigned int)(text[digits++] - '0');
+        }
+        if (digits == length || text[digits] != ' ') digits = 0;
+    }
+    contact->addressNumber = digits > 0 ? number : 0;
+    if (digits > 0) {
+        text += digits + 1;
+        length -= digits + 1;
+    }
+    contact->address = storeString(arena, pool, text, length);
+    return contact->address != NULL;
+}
+
+#define ADDRESS_NUMBER_SIZE 11 // longest house number split off an address, with its space
+
+// Writes the house number compact storage split off the address, and the space after it, to
+// out; returns its length, 0 when the address is stored whole. The full address is this
+// followed by contact->address.
+size_t formatAddressNumber(char *out, const Contact *contact) {
+    unsigned int number = contact->addressNumber;
+    if (number == 0) return 0;
+    char digits[10];
+    size_t count = 0;
+    while (number > 0) {
+        digits[count++] = (char)('0' + number % 10);
+        number /= 10;
+    }
+    for (size_t i = 0; i < count; i++) out[i] = digits[count - 1 - i];
+    out[count] = ' ';
+    return count + 1;
+}
+
+// Length of the full address
+size_t contactAddressLength(const Contact *contact) {
+    char number[ADDRESS_NUMBER_SIZE];
+    return formatAddressNumber(number, contact) + strlen(contact->address);
+}
+
+// Whether books use compact storage: ADDRESSBOOK_COMPACT set to anything but 0
+int compactStorageEnabled(void) {
+    const char *setting = getenv("ADDRESSBOOK_COMPACT");
+    return setting && *setting && strcmp(setting, "0") != 0;
+}
+
+// Adds a contact to the end of a batch (loader output, query results)
+int addToBatch(ContactBatch *batch, Contact *contact) {
+    if (batch->count == batch->capacity) {
+        int capacity = batch->capacity ? batch->capacity * 2 : 64;
+        Contact **items = (Contact **)realloc(batch->items, capacity * sizeof(Contact *));
+        if (!items) {
+            printf("Error: Memory reallocation failed in addToBatch\n");
+            return 0;
+        }
+        batch->items = items;
+        batch->capacity = capacity;
+    }
+    batch->items[batch->count++] = contact;
+    return 1;
+}
+
+// FNV-1a over "firstName\0familyName"
+unsigned long long hashFullName(const char *firstName, const char *familyName) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)firstName; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    hash *= 1099511628211ULL; // separator, so "ab"+"c" and "a"+"bc" differ
+    for (const unsigned char *p = (const unsigned char *)familyName; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Spreads a phone number over all 64 bits (the table is indexed by the low ones)
+unsigned long long hashPhone(long long phoneNum) {
+    unsigned long long hash = (unsigned long long)phoneNum;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+unsigned long long nameHashOf(const Contact *contact) {
+    return hashFullName(contact->firstName, contact->familyName);
+}
+
+unsigned long long phoneHashOf(const Contact *contact) {
+    return hashPhone(contact->phoneNum);
+}
+
+// Releases the index table
+void hashIndexFree(HashIndex *index) {
+    free(index->entries);
+    index->entries = NULL;
+    index->capacity = index->size = index->used = 0;
+}
+
+// Places a contact in a table known to have room, without touching the counters
+void hashIndexPlace(HashIndexEntry *entries, size_t capacity, unsigned long long hash, Contact *contact) {
+    size_t mask = capacity - 1;
+    size_t i = (size_t)hash & mask;
+    while (entries[i].contact != NULL && entries[i].contact != HASH_INDEX_TOMBSTONE) i = (i + 1) & mask;
+    entries[i].hash = hash;
+    entries[i].contact = contact;
+}
+
+// Grows (or just cleans out tombstones) so the table holds at least minCapacity slots
+int hashIndexResize(HashIndex *index, size_t minCapacity) {
+    size_t capacity = 16;
+    while (capacity < minCapacity) capacity *= 2;
+    HashIndexEntry *entries = (HashIndexEntry *)calloc(capacity, sizeof(HashIndexEntry));
+    if (!entries) {
+        printf("Error: Memory allocation failed in hashIndexResize\n");
+        return 0;
+    }
+    for (size_t i = 0; i < index->capacity; i++) {
+        Contact *contact = index->entries[i].contact;
+        if (contact != NULL && contact != HASH_INDEX_TOMBSTONE)
+            hashIndexPlace(entries, capacity, index->entries[i].hash, contact);
+    }
+    free(index->entries);
+    index->entries = entries;
+    index->capacity = capacity;
+    index->used = index->size;
+    METRIC_ADD(METRIC_HASH_RESIZES, 1);
+    return 1;
+}
+
+// Makes room for extra more entries (load factor kept under 1/2, tombstones included)
+int hashIndexReserve(HashIndex *index, size_t extra) {
+    if ((index->used + extra) * 2 <= index->capacity) return 1;
+    return hashIndexResize(index, (index->size + extra) * 4);
+}
+
+// Places a contact with a precomputed hash; the caller has made sure the table has room
+int hashIndexInsertHashed(HashIndex *index, Contact *contact, unsigned long long hash) {
+    size_t mask = index->capacity - 1;
+    size_t i = (size_t)hash & mask;
+    while (index->entries[i].contact != NULL) {
+        if (index->entries[i].contact == HASH_INDEX_TOMBSTONE) {
+            index->entries[i].hash = hash;
+            index->entries[i].contact = contact;
+            index->size++;
+            return 1;
+        }
+        i = (i + 1) & mask;
+    }
+    index->entries[i].hash = hash;
+    index->entries[i].contact = contact;
+    index->size++;
+    index->used++;
+    return 1;
+}
+
+// Indexes a run of contacts: sizes the table once, then hashes a few entries ahead
+// and prefetches their slots so the cache misses of consecutive inserts overlap.
+// knownHashes, when not NULL, holds the precomputed hash of every contact.
+int hashIndexInsertMany(HashIndex *index, Contact **contacts, int count, const uint64_t *knownHashes,
+                        unsigned long long (*hashOf)(const Contact *)) {
+    enum { LOOKAHEAD = 8 };
+    unsigned long long hashes[LOOKAHEAD];
+    if (!hashIndexReserve(index, count)) return 0;
+    size_t mask = index->capacity - 1;
+    for (int i = 0; i < count + LOOKAHEAD; i++) {
+        // Insert contact i - LOOKAHEAD before its ring slot is reused for contact i
+        int j = i - LOOKAHEAD;
+        if (j >= 0) hashIndexInsertHashed(index, contacts[j], hashes[j % LOOKAHEAD]);
+        if (i < count) {
+            hashes[i % LOOKAHEAD] = knownHashes ? knownHashes[i] : hashOf(contacts[i]);
+            __builtin_prefetch(&index->entries[(size_t)hashes[i % LOOKAHEAD] & mask], 1);
+        }
+    }
+    return 1;
+}
+
+// Drops this exact contact, which was indexed under hash
+void hashIndexRemoveHashed(HashIndex *index, Contact *contact, unsigned long long hash) {
+    if (index->capacity == 0) return;
+    size_t mask = index->capacity - 1;
+    size_t i = (size_t)hash & mask;
+    while (index->entries[i].contact != NULL) {
+        if (index->entries[i].contact == contact) {
+            index->entries[i].contact = HASH_INDEX_TOMBSTONE;
+            index->size--;
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+// Points the entry of old at contact, which has the same key
+void hashIndexReplace(HashIndex *index, Contact *old, Contact *contact, unsigned long long hash) {
+    if (index->capacity == 0) return;
+    size_t mask = index->capacity - 1;
+    for (size_t i = (size_t)hash & mask; index->entries[i].contact != NULL; i = (i + 1) & mask) {
+        if (index->entries[i].contact == old) {
+            index->entries[i].contact = contact;
+            return;
+        }
+    }
+}
+
+// Adds a contact to the full-name index
+int nameIndexInsert(HashIndex *index, Contact *contact) {
+    if (!hashIndexReserve(index, 1)) return 0;
+    return hashIndexInsertHashed(index, contact, nameHashOf(contact));
+}
+
+// Drops this exact contact from the full-name index (its name fields must be the ones it was indexed under)
+void nameIndexRemove(HashIndex *index, Contact *contact) {
+    hashIndexRemoveHashed(index, contact, nameHashOf(contact));
+}
+
+// Returns some contact with this full name, or NULL
+Contact *nameIndexFind(HashIndex *index, const char *firstName, const char *familyName) {
+    if (index->capacity == 0) return NULL;
+    unsigned long long hash = hashFullName(firstName, familyName);
+    size_t mask = index->capacity - 1;
+    size_t i = (size_t)hash & mask;
+    while (index->entries[i].contact != NULL) {
+        Contact *contact = index->entries[i].contact;
+        if (contact != HASH_INDEX_TOMBSTONE && index->entries[i].hash == hash &&
+            strcmp(contact->firstName, firstName) == 0 &&
+            strcmp(contact->familyName, familyName) == 0) {
+            return contact;
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+// Every contact named firstName familyName, in index order (not book order)
+int nameIndexFindAll(HashIndex *index, const char *firstName, const char *familyName, ContactBatch *results) {
+    if (index->capacity == 0) return 0;
+    unsigned long long hash = hashFullName(firstName, familyName);
+    size_t mask = index->capacity - 1;
+    size_t i = (size_t)hash & mask;
+    int found = 0;
+    while (index->entries[i].contact != NULL) {
+        Contact *contact = index->entries[i].contact;
+        if (contact != HASH_INDEX_TOMBSTONE && index->entries[i].hash == hash &&
+            strcmp(contact->firstName, firstName) == 0 &&
+            strcmp(contact->familyName, familyName) == 0) {
+            if (!addToBatch(results, contact)) return found;
+            found++;
+        }
+        i = (i + 1) & mask;
+    }
+    return found;
+}
+
+// Orders contacts by family name, then first name
+int compareContactNames(const Contact *a, const Contact *b) {
+    int cmp = strcmp(a->familyName, b->familyName);
+    if (cmp != 0) return cmp;
+    return strcmp(a->firstName, b->firstName);
+}
+
+// qsort adapter for an array of Contact pointers
+int compareContactPointers(const void *a, const void *b) {
+    return compareContactNames(*(Contact *const *)a, *(Contact *const *)b);
+}
+
+// Orders ContactPosition entries by name, equal names by position (a stable sort with qsort)
+int compareNamesThenPosition(const void *a, const void *b) {
+    const ContactPosition *left = (const ContactPosition *)a;
+    const ContactPosition *right = (const ContactPosition *)b;
+    int result = compareContactNames(left->contact, right->contact);
+    if (result != 0) return result;
+    return (left->position > right->position) - (left->position < right->position);
+}
+
+// Orders contacts by first name, then family name
+int compareFirstNames(const Contact *a, const Contact *b) {
+    int cmp = strcmp(a->firstName, b->firstName);
+    if (cmp != 0) return cmp;
+    return strcmp(a->familyName, b->familyName);
+}
+
+int compareFirstNamePointers(const void *a, const void *b) {
+    return compareFirstNames(*(Contact *const *)a, *(Contact *const *)b);
+}
+
+const char *familyNameOf(const Contact *contact) {
+    return contact->familyName;
+}
+
+const char *firstNameOf(const Contact *contact) {
+    return contact->firstName;
+}
+
+// Sets up an empty, stale sorted index for the given ordering
+void sortedIndexInit(SortedIndex *index, int (*compare)(const Contact *, const Contact *),
+                     int (*comparePointers)(const void *, const void *), const char *(*key)(const Contact *)) {
+    index->items = NULL;
+    index->count = index->capacity = 0;
+    index->stale = 1;
+    index->compare = compare;
+    index->comparePointers = comparePointers;
+    index->key = key;
+}
+
+void sortedIndexFree(SortedIndex *index) {
+    free(index->items);
+    index->items = NULL;
+    index->count = index->capacity = 0;
+    index->stale = 1;
+}
+
+// First position whose item is not ordered before contact (after it as well when upper is set)
+int sortedIndexBound(SortedIndex *index, const Contact *contact, int upper) {
+    int low = 0, high = index->count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        int cmp = index->compare(index->items[middle], contact);
+        if (cmp < 0 || (upper && cmp == 0)) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+// Keeps a fresh index current; a stale one is left for the next query to rebuild
+void sortedIndexInsert(SortedIndex *index, Contact *contact) {
+    if (index->stale) return;
+    if (index->count == index->capacity) {
+        int capacity = index->capacity ? index->capacity + index->capacity / 2 : 64;
+        Contact **items = (Contact **)realloc(index->items, capacity * sizeof(Contact *));
+        if (!items) {
+            index->stale = 1;
+            return;
+        }
+        index->items = items;
+        index->capacity = capacity;
+    }
+    int position = sortedIndexBound(index, contact, 1);
+    memmove(&index->items[position + 1], &index->items[position], (index->count - position) * sizeof(Contact *));
+    index->items[position] = contact;
+    index->count++;
+}
+
+// Drops this exact contact (its fields must be the ones it was indexed under)
+void sortedIndexRemove(SortedIndex *index, Contact *contact) {
+    if (index->stale) return;
+    for (int i = sortedIndexBound(index, contact, 0); i < index->count; i++) {
+        if (index->items[i] == contact) {
+            memmove(&index->items[i], &index->items[i + 1], (index->count - i - 1) * sizeof(Contact *));
+            index->count--;
+            return;
+        }
+        if (index->compare(index->items[i], contact) != 0) return;
+    }
+}
+
+// Swaps old for contact in place; both sort the same
+void sortedIndexReplace(SortedIndex *index, Contact *old, Contact *contact) {
+    if (index->stale) return;
+    for (int i = sortedIndexBound(index, old, 0); i < index->count; i++) {
+        if (index->items[i] == old) {
+            index->items[i] = contact;
+            return;
+        }
+        if (index->compare(index->items[i], old) != 0) return;
+    }
+}
+
+// Re-sorts a stale index from the book's contacts
+int sortedIndexRebuild(SortedIndex *index, Contact **contacts, int count) {
+    if (count > index->capacity) {
+        Contact **items = (Contact **)realloc(index->items, count * sizeof(Contact *));
+        if (!items) {
+            printf("Error: Memory reallocation failed in sortedIndexRebuild\n");
+            return 0;
+        }
+        index->items = items;
+        index->capacity = count;
+    }
+    if (count > 0) memcpy(index->items, contacts, count * sizeof(Contact *));
+    index->count = count;
+    qsort(index->items, count, sizeof(Contact *), index->comparePointers);
+    index->stale = 0;
+    METRIC_ADD(METRIC_SORTED_INDEX_REBUILDS, 1);
+    return 1;
+}
+
+// Collects every contact whose key field starts with prefix, in index order
+int sortedIndexFindPrefix(SortedIndex *index, const char *prefix, ContactBatch *results) {
+    size_t length = strlen(prefix);
+    int low = 0, high = index->count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (strcmp(index->key(index->items[middle]), prefix) < 0) low = middle + 1;
+        else high = middle;
+    }
+    int found = 0;
+    for (int i = low; i < index->count && strncmp(index->key(index->items[i]), prefix, length) == 0; i++) {
+        if (!addToBatch(results, index->items[i])) break;
+        found++;
+    }
+    return found;
+}
+
+OrderNode *orderNodeNew(int leaf) {
+    OrderNode *node = (OrderNode *)malloc(sizeof(OrderNode));
+    if (!node) return NULL;
+    node->leaf = leaf;
+    node->count = node->total = 0;
+    node->first = NULL;
+    return node;
+}
+
+void orderNodeFree(OrderNode *node) {
+    if (!node) return;
+    if (!node->leaf) {
+        for (int i = 0; i < node->count; i++) orderNodeFree(node->children[i]);
+    }
+    free(node);
+}
+
+// Recomputes total and first after the node's own items changed
+void orderNodeUpdate(OrderNode *node) {
+    if (node->leaf) {
+        node->total = node->count;
+        node->first = node->count > 0 ? node->contacts[0] : NULL;
+        return;
+    }
+    int total = 0;
+    for (int i = 0; i < node->count; i++) total += node->children[i]->total;
+    node->total = total;
+    node->first = node->count > 0 ? node->children[0]->first : NULL;
+}
+
+// Child of an inner node that holds position, which becomes relative to that child;
+// the end of the subtree belongs to the last child
+int orderChildAt(OrderNode *node, int *position) {
+    int i = 0;
+    while (i < node->count - 1 && *position >= node->children[i]->total) {
+        *position -= node->children[i]->total;
+        i++;
+    }
+    return i;
+}
+
+Contact *orderGet(OrderNode *node, int position) {
+    while (!node->leaf) node = node->children[orderChildAt(node, &position)];
+    return node->contacts[position];
+}
+
+void orderSet(OrderNode *node, int position, Contact *contact) {
+    if (node->leaf) {
+        node->contacts[position] = contact;
+    } else {
+        int i = orderChildAt(node, &position);
+        orderSet(node->children[i], position, contact);
+    }
+    node->first = node->leaf ? node->contacts[0] : node->children[0]->first;
+}
+
+// Inserts contact at position of the subtree. A full node splits in two and hands its upper
+// half back in split. Returns 0, with the subtree unchanged, when a node could not be allocated.
+int orderNodeInsert(OrderNode *node, int position, Contact *contact, OrderNode **split) {
+    *split = NULL;
+    // A full inner node may have to take one more child, get its other half before changing anything
+    OrderNode *spare = NULL;
+    if (node->count == ORDER_NODE_SIZE && !(spare = orderNodeNew(node->leaf))) return 0;
+    int half = ORDER_NODE_SIZE / 2;
+    if (node->leaf) {
+        OrderNode *target = node;
+        if (spare) {
+            memcpy(spare->contacts, node->contacts + half, (ORDER_NODE_SIZE - half) * sizeof(Contact *));
+            spare->count = ORDER_NODE_SIZE - half;
+            node->count = half;
+            if (position > half) {
+                target = spare;
+                position -= half;
+            }
+        }
+        memmove(&target->contacts[position + 1], &target->contacts[position],
+                (target->count - position) * sizeof(Contact *));
+        target->contacts[position] = contact;
+        target->count++;
+    } else {
+        int i = orderChildAt(node, &position);
+        OrderNode *childSplit;
+        if (!orderNodeInsert(node->children[i], position, contact, &childSplit)) {
+            free(spare);
+            return 0;
+        }
+        if (!childSplit) {
+            free(spare);
+            spare = NULL;
+        } else {
+            OrderNode *target = node;
+            int at = i + 1;
+            if (spare) {
+                memcpy(spare->children, node->children + half, (ORDER_NODE_SIZE - half) * sizeof(OrderNode *));
+                spare->count = ORDER_NODE_SIZE - half;
+                node->count = half;
+                if (at > half) {
+                    target = spare;
+                    at -= half;
+                }
+            }
+            memmove(&target->children[at + 1], &target->children[at], (target->count - at) * sizeof(OrderNode *));
+            target->children[at] = childSplit;
+            target->count++;
+        }
+    }
+    orderNodeUpdate(node);
+    if (spare) orderNodeUpdate(spare);
+    *split = spare;
+    return 1;
+}
+
+// Inserts contact at position of the book order, growing a new root when the old one splits
+int orderInsert(ContactOrder *order, int position, Contact *contact) {
+    OrderNode *root = NULL, *split;
+    if (order->root->count == ORDER_NODE_SIZE && !(root = orderNodeNew(0))) return 0;
+    if (!orderNodeInsert(order->root, position, contact, &split)) {
+        free(root);
+        return 0;
+    }
+    if (split) {
+        root->children[0] = order->root;
+        root->children[1] = split;
+        root->count = 2;
+        orderNodeUpdate(root);
+        order->root = root;
+    } else {
+        free(root);
+    }
+    return 1;
+}
+
+// Removes the contact at position of the subtree. A child left empty is dropped and one that
+// fits in a node with a neighbour, without filling it past ORDER_NODE_FILL, is merged into it.
+void orderNodeDelete(OrderNode *node, int position) {
+    if (node->leaf) {
+        memmove(&node->contacts[position], &node->contacts[position + 1],
+                (node->count - position - 1) * sizeof(Contact *));
+        node->count--;
+        orderNodeUpdate(node);
+        return;
+    }
+    int i = orderChildAt(node, &position);
+    OrderNode *child = node->children[i];
+    orderNodeDelete(child, position);
+    int left = -1;
+    if (child->total == 0 && node->count > 1) {
+        orderNodeFree(child);
+        memmove(&node->children[i], &node->children[i + 1], (node->count - i - 1) * sizeof(OrderNode *));
+        node->count--;
+    } else if (i + 1 < node->count && child->count + node->children[i + 1]->count <= ORDER_NODE_FILL) {
+        left = i;
+    } else if (i > 0 && node->children[i - 1]->count + child->count <= ORDER_NODE_FILL) {
+        left = i - 1;
+    }
+    if (left >= 0) {
+        OrderNode *into = node->children[left], *from = node->children[left + 1];
+        if (into->leaf) {
+            memcpy(into->contacts + into->count, from->contacts, from->count * sizeof(Contact *));
+        } else {
+            memcpy(into->children + into->count, from->children, from->count * sizeof(OrderNode *));
+        }
+        into->count += from->count;
+        orderNodeUpdate(into);
+        free(from); // its items moved, so not orderNodeFree
+        memmove(&node->children[left + 1], &node->children[left + 2],
+                (node->count - left - 2) * sizeof(OrderNode *));
+        node->count--;
+    }
+    orderNodeUpdate(node);
+}
+
+// Removes the contact at position of the book order, dropping roots left with a single child
+void orderDelete(ContactOrder *order, int position) {
+    orderNodeDelete(order->root, position);
+    while (!order->root->leaf && order->root->count == 1) {
+        OrderNode *root = order->root;
+        order->root = root->children[0];
+        free(root);
+    }
+}
+
+// Builds a tree of count contacts in this order, bottom up with nodes ORDER_NODE_FILL full;
+// NULL when out of memory
+OrderNode *orderBuild(Contact **contacts, int count) {
+    int levelCount = count > 0 ? (count + ORDER_NODE_FILL - 1) / ORDER_NODE_FILL : 1;
+    OrderNode **level = (OrderNode **)malloc(levelCount * sizeof(OrderNode *));
+    if (!level) return NULL;
+    for (int i = 0; i < levelCount; i++) {
+        level[i] = orderNodeNew(1);
+        if (!level[i]) {
+            while (i > 0) free(level[--i]);
+            free(level);
+            return NULL;
+        }
+        int start = i * ORDER_NODE_FILL;
+        int length = count - start < ORDER_NODE_FILL ? count - start : ORDER_NODE_FILL;
+        if (length > 0) memcpy(level[i]->contacts, contacts + start, length * sizeof(Contact *));
+        level[i]->count = length;
+        orderNodeUpdate(level[i]);
+    }
+    // Each pass replaces the level by its parents, parent i going where its first child was read from
+    while (levelCount > 1) {
+        int parents = (levelCount + ORDER_NODE_FILL - 1) / ORDER_NODE_FILL;
+        for (int i = 0; i < parents; i++) {
+            OrderNode *node = orderNodeNew(0);
+            if (!node) {
+                for (int j = 0; j < i; j++) orderNodeFree(level[j]);
+                for (int j = i * ORDER_NODE_FILL; j < levelCount; j++) orderNodeFree(level[j]);
+                free(level);
+                return NULL;
+            }
+            int start = i * ORDER_NODE_FILL;
+            int length = levelCount - start < ORDER_NODE_FILL ? levelCount - start : ORDER_NODE_FILL;
+            memcpy(node->children, level + start, length * sizeof(OrderNode *));
+            node->count = length;
+            orderNodeUpdate(node);
+            level[i] = node;
+        }
+        levelCount = parents;
+    }
+    OrderNode *root = level[0];
+    free(level);
+    METRIC_ADD(METRIC_ORDER_BUILDS, 1);
+    return root;
+}
+
+// Copies the subtree's contacts in order to contacts, returns how many there were
+int orderNodeFlatten(OrderNode *node, Contact **contacts) {
+    if (node->leaf) {
+        memcpy(contacts, node->contacts, node->count * sizeof(Contact *));
+        return node->count;
+    }
+    int copied = 0;
+    for (int i = 0; i < node->count; i++) copied += orderNodeFlatten(node->children[i], contacts + copied);
+    return copied;
+}
+
+// First position whose contact is not ordered before contact (after it as well when upper is
+// set), for a subtree in alphabetical order
+int orderBound(OrderNode *node, const Contact *contact, int upper) {
+    int position = 0;
+    while (!node->leaf) {
+        // The bound is in the last child whose first contact comes before contact
+        int low = 1, high = node->count;
+        while (low < high) {
+            int middle = low + (high - low) / 2;
+            int cmp = compareContactNames(node->children[middle]->first, contact);
+            if (cmp < 0 || (upper && cmp == 0)) low = middle + 1;
+            else high = middle;
+        }
+        for (int i = 0; i < low - 1; i++) position += node->children[i]->total;
+        node = node->children[low - 1];
+    }
+    int low = 0, high = node->count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        int cmp = compareContactNames(node->contacts[middle], contact);
+        if (cmp < 0 || (upper && cmp == 0)) low = middle + 1;
+        else high = middle;
+    }
+    return position + low;
+}
+
+void contactColumnsFree(ContactColumns *columns) {
+    free(columns->ages);
+    free(columns->phones);
+    free(columns->familyOffsets);
+    free(columns->familyHeap);
+    free(columns->contacts);
+    memset(columns, 0, sizeof(*columns));
+    columns->stale = 1;
+}
+
+#define COLUMN_BLOCK 1024 // rows per pass of the columnar scan
+
+// Fills the columns from contacts (in this order). The age and phone columns are padded with
+// zeros to whole blocks so the scan loops always run COLUMN_BLOCK times.
+int contactColumnsBuild(ContactColumns *columns, Contact **contacts, int count) {
+    contactColumnsFree(columns);
+    METRIC_ADD(METRIC_COLUMN_BUILDS, 1);
+    size_t heapSize = 0;
+    for (int i = 0; i < count; i++) heapSize += strlen(contacts[i]->familyName) + 1;
+    if (heapSize > UINT32_MAX) {
+        printf("Error: family names too large for the columns in contactColumnsBuild\n");
+        return 0;
+    }
+    size_t rows = count > 0 ? (size_t)count : 1;
+    size_t padded = ((size_t)count + COLUMN_BLOCK - 1) / COLUMN_BLOCK * COLUMN_BLOCK;
+    columns->ages = (uint8_t *)calloc(padded > 0 ? padded : 1, sizeof(uint8_t));
+    columns->phones = (int64_t *)calloc(padded > 0 ? padded : 1, sizeof(int64_t));
+    columns->familyOffsets = (uint32_t *)malloc(rows * sizeof(uint32_t));
+    columns->familyHeap = (char *)malloc(heapSize > 0 ? heapSize : 1);
+    columns->contacts = (Contact **)malloc(rows * sizeof(Contact *));
+    if (!columns->ages || !columns->phones || !columns->familyOffsets || !columns->familyHeap || !columns->contacts) {
+        printf("Error: Memory allocation failed in contactColumnsBuild\n");
+        contactColumnsFree(columns);
+        return 0;
+    }
+    size_t offset = 0;
+    for (int i = 0; i < count; i++) {
+        Contact *contact = contacts[i];
+        if (contact->age < 0 || contact->age > UINT8_MAX) columns->ageOutliers++;
+        columns->ages[i] = (uint8_t)(contact->age < 0 ? 0 : contact->age > UINT8_MAX ? UINT8_MAX : contact->age);
+        columns->phones[i] = contact->phoneNum;
+        size_t length = strlen(contact->familyName) + 1;
+        memcpy(columns->familyHeap + offset, contact->familyName, length);
+        columns->familyOffsets[i] = (uint32_t)offset;
+        offset += length;
+        columns->contacts[i] = contact;
+    }
+    columns->count = count;
+    columns->stale = 0;
+    return 1;
+}
+
+void aggregateInit(ContactAggregate *aggregate) {
+    aggregate->count = 0;
+    aggregate->ageSum = 0;
+    aggregate->minAge = INT_MAX;
+    aggregate->maxAge = INT_MIN;
+}
+
+// Row-at-a-time filter over contacts, the reference for the columnar scan
+int filterContacts(Contact **contacts, int count, const ContactFilter *filter, ContactBatch *results,
+                   ContactAggregate *aggregate) {
+    size_t prefixLength = filter->familyPrefix ? strlen(filter->familyPrefix) : 0;
+    aggregateInit(aggregate);
+    for (int i = 0; i < count; i++) {
+        Contact *contact = contacts[i];
+        if (contact->age < filter->minAge || contact->age > filter->maxAge ||
+            contact->phoneNum < filter->minPhone || contact->phoneNum > filter->maxPhone ||
+            (prefixLength > 0 && strncmp(contact->familyName, filter->familyPrefix, prefixLength) != 0)) {
+            continue;
+        }
+        aggregate->count++;
+        aggregate->ageSum += contact->age;
+        if (contact->age < aggregate->minAge) aggregate->minAge = contact->age;
+        if (contact->age > aggregate->maxAge) aggregate->maxAge = contact->age;
+        if (results && !addToBatch(results, contact)) return 0;
+    }
+    return 1;
+}
+
+// Columnar filter: each block of rows is matched with branch-free compares over the age and
+// phone columns (loops the compiler vectorizes), the family-name prefix is then only checked
+// for rows still matching, and the aggregates are summed over the match flags
+int filterContactColumns(const ContactColumns *columns, const ContactFilter *filter, ContactBatch *results,
+                         ContactAggregate *aggregate) {
+    uint8_t match[COLUMN_BLOCK];
+    size_t prefixLength = filter->familyPrefix ? strlen(filter->familyPrefix) : 0;
+    uint8_t minAge = (uint8_t)(filter->minAge < 0 ? 0 : filter->minAge > UINT8_MAX ? UINT8_MAX : filter->minAge);
+    uint8_t maxAge = (uint8_t)(filter->maxAge < 0 ? 0 : filter->maxAge > UINT8_MAX ? UINT8_MAX : filter->maxAge);
+    int64_t minPhone = filter->minPhone;
+    int64_t maxPhone = filter->maxPhone;
+    aggregateInit(aggregate);
+    if (filter->minAge > filter->maxAge || filter->minAge > UINT8_MAX || filter->maxAge < 0) return 1;
+    uint8_t blockMin = UINT8_MAX, blockMax = 0;
+    for (int base = 0; base < columns->count; base += COLUMN_BLOCK) {
+        int rows = columns->count - base < COLUMN_BLOCK ? columns->count - base : COLUMN_BLOCK;
+        const uint8_t *ages = columns->ages + base;
+        const int64_t *phones = columns->phones + base;
+        for (int i = 0; i < COLUMN_BLOCK; i++) {
+            match[i] = (uint8_t)((ages[i] >= minAge) & (ages[i] <= maxAge));
+        }
+        for (int i = 0; i < COLUMN_BLOCK; i++) {
+            match[i] &= (uint8_t)((phones[i] >= minPhone) & (phones[i] <= maxPhone));
+        }
+        for (int i = rows; i < COLUMN_BLOCK; i++) match[i] = 0; // padding
+        if (prefixLength > 0) {
+            for (int i = 0; i < rows; i++) {
+                if (match[i] && strncmp(columns->familyHeap + columns->familyOffsets[base + i], filter->familyPrefix,
+                                        prefixLength) != 0) {
+                    match[i] = 0;
+                }
+            }
+        }
+        // match is 0 or 1: masked holds the age of matching rows and 0 elsewhere, padded the
+        // age of matching rows and 255 elsewhere
+        unsigned count = 0, ageSum = 0;
+        for (int i = 0; i < COLUMN_BLOCK; i++) {
+            uint8_t masked = (uint8_t)(ages[i] & (uint8_t)-match[i]);
+            count += match[i];
+            ageSum += masked;
+        }
+        for (int i = 0; i < COLUMN_BLOCK; i++) {
+            uint8_t masked = (uint8_t)(ages[i] & (uint8_t)-match[i]);
+            uint8_t padded = (uint8_t)(ages[i] | (uint8_t)(match[i] - 1));
+            blockMin = padded < blockMin ? padded : blockMin;
+            blockMax = masked > blockMax ? masked : blockMax;
+        }
+        aggregate->count += count;
+        aggregate->ageSum += ageSum;
+        if (results && count > 0) {
+            for (int i = 0; i < rows; i++) {
+                if (match[i] && !addToBatch(results, columns->contacts[base + i])) return 0;
+            }
+        }
+    }
+    if (aggregate->count > 0) {
+        aggregate->minAge = blockMin;
+        aggregate->maxAge = blockMax;
+    }
+    return 1;
+}
+
+// Filters the book in book order, filling results (if not NULL) and the aggregate. The
+// columns are rebuilt first when the book changed since the last query.
+int findContactsByFilter(AddressBook *book, const ContactFilter *filter, ContactBatch *results,
+                         ContactAggregate *aggregate) {
+    METRIC_TIMER(started);
+    ContactColumns *columns = &book->columns;
+    Contact **contacts = bookContacts(book);
+    if (columns->stale) contactColumnsBuild(columns, contacts, book->count);
+    int ok;
+    if (columns->stale || columns->ageOutliers > 0) {
+        ok = filterContacts(contacts, book->count, filter, results, aggregate);
+    } else {
+        ok = filterContactColumns(columns, filter, results, aggregate);
+    }
+    METRIC_TIME(METRIC_FILTER, started);
+    return ok;
+}
+
+void fuzzyIndexFree(FuzzyIndex *index) {
+    free(index->offsets);
+    free(index->postings);
+    free(index->hits);
+    memset(index, 0, sizeof(*index));
+    index->stale = 1;
+}
+
+size_t fuzzyKeyLength(const Contact *contact, int key) {
+    if (key == FUZZY_FULL_NAME) return strlen(contact->firstName) + 1 + strlen(contact->familyName);
+    if (key == FUZZY_FIRST_NAME) return strlen(contact->firstName);
+    if (key == FUZZY_FAMILY_NAME) return strlen(contact->familyName);
+    return contactAddressLength(contact);
+}
+
+// Writes the key of contact folded to lower case into buffer (grown as needed); returns its
+// length or -1 when out of memory
+int fuzzyFoldKey(const Contact *contact, int key, char **buffer, size_t *capacity) {
+    const char *first = key == FUZZY_FAMILY_NAME ? contact->familyName
+                      : key == FUZZY_ADDRESS     ? contact->address
+                                                 : contact->firstName;
+    const char *second = key == FUZZY_FULL_NAME ? contact->familyName : NULL;
+    char number[ADDRESS_NUMBER_SIZE];
+    if (key == FUZZY_ADDRESS && contact->addressNumber != 0) {
+        // House number, then the rest of the address after the space
+        number[formatAddressNumber(number, contact) - 1] = '\0';
+        first = number;
+        second = contact->address;
+    }
+    size_t firstLength = strlen(first);
+    size_t length = firstLength + (second ? strlen(second) + 1 : 0);
+    if (length > INT_MAX - 1) return -1;
+    if (length + 1 > *capacity) {
+        size_t newCapacity = *capacity > 0 ? *capacity : 64;
+        while (newCapacity < length + 1) newCapacity *= 2;
+        char *grown = (char *)realloc(*buffer, newCapacity);
+        if (!grown) return -1;
+        *buffer = grown;
+        *capacity = newCapacity;
+    }
+    char *out = *buffer;
+    memcpy(out, first, firstLength);
+    if (second) {
+        out[firstLength] = ' ';
+        memcpy(out + firstLength + 1, second, length - firstLength - 1);
+    }
+    for (size_t i = 0; i < length; i++) out[i] = (char)tolower((unsigned char)out[i]);
+    out[length] = '\0';
+    return (int)length;
+}
+
+// 6-bit code of a folded character: letters, digits and space get their own, anything else
+// shares the rest (which only widens the postings searched); 0 is the padding
+uint32_t fuzzyCharCode(unsigned char c) {
+    if (c >= 'a' && c <= 'z') return 1 + (c - 'a');
+    if (c >= '0' && c <= '9') return 27 + (c - '0');
+    if (c == ' ') return 37;
+    return 38 + c % 26;
+}
+
+// Trigram i of a folded text of length n, for i in 0..n-1
+uint32_t fuzzyGram(const char *text, int n, int i) {
+    uint32_t a = i > 0 ? fuzzyCharCode((unsigned char)text[i - 1]) : 0;
+    uint32_t b = fuzzyCharCode((unsigned char)text[i]);
+    uint32_t c = i + 1 < n ? fuzzyCharCode((unsigned char)text[i + 1]) : 0;
+    return a << 12 | b << 6 | c;
+}
+
+// Builds the index of one key over contacts with a counting pass and a filling pass; lastRow
+// remembers the last row seen for each gram so a row is only listed once per gram
+int fuzzyIndexBuild(FuzzyIndex *index, Contact **contacts, int count, int key) {
+    fuzzyIndexFree(index);
+    METRIC_ADD(METRIC_FUZZY_INDEX_BUILDS, 1);
+    uint32_t *lastRow = (uint32_t *)calloc(FUZZY_GRAMS, sizeof(uint32_t));
+    index->offsets = (uint32_t *)calloc(FUZZY_GRAMS + 1, sizeof(uint32_t));
+    char *text = NULL;
+    size_t capacity = 0;
+    uint64_t total = 0;
+    int ok = lastRow && index->offsets;
+    for (int row = 0; ok && row < count; row++) {
+        int length = fuzzyFoldKey(contacts[row], key, &text, &capacity);
+        ok = length >= 0;
+        for (int i = 0; i < length; i++) {
+            uint32_t gram = fuzzyGram(text, length, i);
+            if (lastRow[gram] == (uint32_t)row + 1) continue;
+            lastRow[gram] = (uint32_t)row + 1;
+            index->offsets[gram + 1]++;
+            total++;
+        }
+    }
+    if (ok && total <= UINT32_MAX) {
+        index->postings = (uint32_t *)malloc((total > 0 ? total : 1) * sizeof(uint32_t));
+        index->hits = (uint8_t *)calloc(count > 0 ? count : 1, sizeof(uint8_t));
+        ok = index->postings && index->hits;
+    }
+    if (!ok) {
+        printf("Error: Memory allocation failed in fuzzyIndexBuild\n");
+    } else if (total > UINT32_MAX) {
+        printf("Error: too many trigrams for the fuzzy index in fuzzyIndexBuild\n");
+        ok = 0;
+    } else {
+        for (int gram = 0; gram < FUZZY_GRAMS; gram++) index->offsets[gram + 1] += index->offsets[gram];
+        memset(lastRow, 0, FUZZY_GRAMS * sizeof(uint32_t));
+        // offsets[gram] serves as the fill cursor and ends at the start of the next gram
+        for (int row = 0; row < count; row++) {
+            int length = fuzzyFoldKey(contacts[row], key, &text, &capacity);
+            for (int i = 0; i < length; i++) {
+                uint32_t gram = fuzzyGram(text, length, i);
+                if (lastRow[gram] == (uint32_t)row + 1) continue;
+                lastRow[gram] = (uint32_t)row + 1;
+                index->postings[index->offsets[gram]++] = (uint32_t)row;
+            }
+        }
+        memmove(index->offsets + 1, index->offsets, FUZZY_GRAMS * sizeof(uint32_t));
+        index->offsets[0] = 0;
+        index->count = count;
+        index->stale = 0;
+    }
+    free(lastRow);
+    free(text);
+    if (!ok) fuzzyIndexFree(index);
+    return ok;
+}
+
+// Edit distance (Levenshtein) between a pattern of up to 64 characters and text, with Myers'
+// bit-parallel algorithm: one column of the DP matrix per text character, kept as vertical
+// +1/-1 delta bit vectors; peq holds the positions of each character in the pattern
+int myersDistance(const uint64_t *peq, int m, const char *text, int n) {
+    if (m == 0) return n;
+    uint64_t pv = m == 64 ? ~0ULL : (1ULL << m) - 1;
+    uint64_t mv = 0;
+    uint64_t high = 1ULL << (m - 1);
+    int score = m;
+    for (int j = 0; j < n; j++) {
+        uint64_t eq = peq[(unsigned char)text[j]];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        if (ph & high) score++;
+        else if (mh & high) score--;
+        ph = (ph << 1) | 1; // the first row grows by one per text character
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+    }
+    return score;
+}
+
+// Edit distance for patterns too long for one machine word, a row at a time, giving up once
+// every cell of a row exceeds maxDistance
+int boundedDistance(const char *pattern, int m, const char *text, int n, int maxDistance, int *row) {
+    for (int i = 0; i <= m; i++) row[i] = i;
+    for (int j = 1; j <= n; j++) {
+        int diagonal = row[0];
+        int best = row[0] = j;
+        for (int i = 1; i <= m; i++) {
+            int up = row[i];
+            int cost = diagonal + (pattern[i - 1] != text[j - 1]);
+            if (row[i - 1] + 1 < cost) cost = row[i - 1] + 1;
+            if (up + 1 < cost) cost = up + 1;
+            row[i] = cost;
+            diagonal = up;
+            if (cost < best) best = cost;
+        }
+        if (best > maxDistance) return maxDistance + 1;
+    }
+    return row[m];
+}
+
+int fuzzyQueryInit(FuzzyQuery *query, int key, const char *text, int maxDistance) {
+    memset(query, 0, sizeof(*query));
+    query->key = key;
+    query->maxDistance = maxDistance < 0 ? 0 : maxDistance;
+    size_t length = strlen(text);
+    query->text = (char *)malloc(length + 1);
+    query->row = (int *)malloc((length + 1) * sizeof(int));
+    if (!query->text || !query->row || length > INT_MAX - 1) {
+        printf("Error: Memory allocation failed in fuzzyQueryInit\n");
+        free(query->text);
+        free(query->row);
+        return 0;
+    }
+    for (size_t i = 0; i <= length; i++) query->text[i] = (char)tolower((unsigned char)text[i]);
+    query->length = (int)length;
+    if (length <= 64) {
+        for (size_t i = 0; i < length; i++) query->peq[(unsigned char)query->text[i]] |= 1ULL << i;
+    }
+    return 1;
+}
+
+void fuzzyQueryFree(FuzzyQuery *query) {
+    free(query->text);
+    free(query->row);
+    free(query->buffer);
+    free(query->matches);
+}
+
+// Checks one contact against the query and records it when within maxDistance edits
+int fuzzyCheck(FuzzyQuery *query, Contact *contact, int position) {
+    // Each edit changes the length by at most one
+    int m = query->length;
+    size_t keyLength = fuzzyKeyLength(contact, query->key);
+    if (keyLength + query->maxDistance < (size_t)m || keyLength > (size_t)m + query->maxDistance) return 1;
+    int n = fuzzyFoldKey(contact, query->key, &query->buffer, &query->capacity);
+    if (n < 0) {
+        printf("Error: Memory allocation failed in fuzzyCheck\n");
+        return 0;
+    }
+    int distance = m <= 64 ? myersDistance(query->peq, m, query->buffer, n)
+                           : boundedDistance(query->text, m, query->buffer, n, query->maxDistance, query->row);
+    if (distance > query->maxDistance) return 1;
+    if (query->count == query->matchCapacity) {
+        int newCapacity = query->matchCapacity > 0 ? query->matchCapacity * 2 : 64;
+        FuzzyMatch *grown = (FuzzyMatch *)realloc(query->matches, newCapacity * sizeof(FuzzyMatch));
+        if (!grown) {
+            printf("Error: Memory allocation failed in fuzzyCheck\n");
+            return 0;
+        }
+        query->matches = grown;
+        query->matchCapacity = newCapacity;
+    }
+    query->matches[query->count++] = (FuzzyMatch){contact, distance, position};
+    return 1;
+}
+
+int compareFuzzyMatches(const void *a, const void *b) {
+    const FuzzyMatch *x = (const FuzzyMatch *)a;
+    const FuzzyMatch *y = (const FuzzyMatch *)b;
+    if (x->distance != y->distance) return x->distance < y->distance ? -1 : 1;
+    return (x->position > y->position) - (x->position < y->position);
+}
+
+// Copies the best limit matches, fewest edits first, into matches and returns how many
+int fuzzyRank(FuzzyQuery *query, int limit, FuzzyMatch *matches) {
+    // No matches leaves the array unallocated, and qsort must not be given NULL
+    if (query->count > 1) qsort(query->matches, query->count, sizeof(FuzzyMatch), compareFuzzyMatches);
+    int count = query->count < limit ? query->count : limit;
+    if (count > 0) memcpy(matches, query->matches, count * sizeof(FuzzyMatch));
+    return count;
+}
+
+void *fuzzyScanChunk(void *arg) {
+    FuzzyScanChunk *chunk = (FuzzyScanChunk *)arg;
+    for (int i = chunk->first; i < chunk->first + chunk->count && chunk->ok; i++) {
+        chunk->ok = fuzzyCheck(&chunk->query, chunk->contacts[i], i);
+    }
+    return NULL;
+}
+
+#define FUZZY_PARALLEL_ROWS 65536 // rows per thread before a scan is split
+
+// Checks every contact, for queries the trigrams cannot narrow down and for views. Large
+// scans are split over the worker threads, each with its own copy of the query.
+int fuzzyScan(FuzzyQuery *query, Contact **contacts, int count) {
+    METRIC_ADD(METRIC_FUZZY_ROWS_CHECKED, count);
+    int threads = workerThreadCount();
+    if (count / FUZZY_PARALLEL_ROWS < threads) threads = count / FUZZY_PARALLEL_ROWS;
+    if (threads <= 1) {
+        for (int i = 0; i < count; i++) {
+            if (!fuzzyCheck(query, contacts[i], i)) return 0;
+        }
+        return 1;
+    }
+    FuzzyScanChunk chunks[WORKER_MAX_THREADS];
+    int ok = 1;
+    for (int t = 0; t < threads; t++) {
+        FuzzyScanChunk *chunk = &chunks[t];
+        chunk->query = *query;
+        chunk->query.row = (int *)malloc((query->length + 1) * sizeof(int));
+        chunk->query.buffer = NULL;
+        chunk->query.capacity = 0;
+        chunk->query.matches = NULL;
+        chunk->query.count = chunk->query.matchCapacity = 0;
+        chunk->contacts = contacts;
+        chunk->first = (int)((long long)count * t / threads);
+        chunk->count = (int)((long long)count * (t + 1) / threads) - chunk->first;
+        chunk->ok = chunk->query.row != NULL;
+        if (!chunk->ok) ok = 0;
+    }
+    if (ok) runWorkers(chunks, sizeof(FuzzyScanChunk), threads, fuzzyScanChunk);
+    else printf("Error: Memory allocation failed in fuzzyScan\n");
+    // Chunks hold ascending rows, appending them in order keeps the single-thread order
+    for (int t = 0; t < threads; t++) {
+        FuzzyQuery *part = &chunks[t].query;
+        if (!chunks[t].ok) ok = 0;
+        int total = query->count + part->count;
+        if (ok && total > query->matchCapacity) {
+            FuzzyMatch *grown = (FuzzyMatch *)realloc(query->matches, total * sizeof(FuzzyMatch));
+            if (grown) {
+                query->matches = grown;
+                query->matchCapacity = total;
+            } else {
+                printf("Error: Memory allocation failed in fuzzyScan\n");
+                ok = 0;
+            }
+        }
+        if (ok && part->count > 0) {
+            memcpy(query->matches + query->count, part->matches, part->count * sizeof(FuzzyMatch));
+            query->count = total;
+        }
+        free(part->row);
+        free(part->buffer);
+        free(part->matches);
+    }
+    return ok;
+}
+
+#define FUZZY_MAX_DISTANCE 8
+#define FUZZY_LIST_LIMIT 20 // matches the menu shows
+#define FUZZY_EXTRA_LISTS 3 // postings merged beyond the 3k + 1 needed, to cut the rows checked
+
+// Candidates from the trigram index. A key within k edits of the query keeps all but at most
+// 3k of the query's trigrams (an edit touches at most three), so of any L distinct query
+// trigrams it contains at least L - 3k. The L = 3k + 1 + FUZZY_EXTRA_LISTS rarest trigrams are
+// merged and only rows found in enough of them are checked. Returns -1 when the query has too
+// few distinct trigrams for the bound to exclude anything.
+int fuzzyIndexSearch(FuzzyIndex *index, FuzzyQuery *query, Contact **contacts) {
+    int m = query->length;
+    uint32_t *grams = (uint32_t *)malloc((m > 0 ? m : 1) * sizeof(uint32_t));
+    if (!grams) {
+        printf("Error: Memory allocation failed in fuzzyIndexSearch\n");
+        return 0;
+    }
+    int distinct = 0;
+    for (int i = 0; i < m; i++) {
+        uint32_t gram = fuzzyGram(query->text, m, i);
+        int seen = 0;
+        for (int j = 0; j < distinct && !seen; j++) seen = grams[j] == gram;
+        if (!seen) grams[distinct++] = gram;
+    }
+    int lost = 3 * query->maxDistance;
+    if (distinct <= lost) {
+        free(grams);
+        return -1;
+    }
+    // Rarest first (queries are short, insertion sort will do)
+    for (int i = 1; i < distinct; i++) {
+        uint32_t gram = grams[i];
+        uint32_t size = index->offsets[gram + 1] - index->offsets[gram];
+        int j = i;
+        while (j > 0 && index->offsets[grams[j - 1] + 1] - index->offsets[grams[j - 1]] > size) {
+            grams[j] = grams[j - 1];
+            j--;
+        }
+        grams[j] = gram;
+    }
+    int lists = lost + 1 + FUZZY_EXTRA_LISTS < distinct ? lost + 1 + FUZZY_EXTRA_LISTS : distinct;
+    uint8_t needed = (uint8_t)(lists - lost);
+    // Counts the hits of each row in hits, noting rows as they reach needed, then clears them
+    uint32_t *candidates = NULL;
+    size_t count = 0, capacity = 0;
+    int ok = 1;
+    for (int i = 0; i < lists && ok; i++) {
+        for (uint32_t at = index->offsets[grams[i]]; at < index->offsets[grams[i] + 1]; at++) {
+            uint32_t row = index->postings[at];
+            if (++index->hits[row] != needed) continue;
+            if (count == capacity) {
+                size_t newCapacity = capacity > 0 ? capacity * 2 : 256;
+                uint32_t *grown = (uint32_t *)realloc(candidates, newCapacity * sizeof(uint32_t));
+                if (!grown) {
+                    printf("Error: Memory allocation failed in fuzzyIndexSearch\n");
+                    ok = 0;
+                    break;
+                }
+                candidates = grown;
+                capacity = newCapacity;
+            }
+            candidates[count++] = row;
+        }
+    }
+    for (int i = 0; i < lists; i++) {
+        for (uint32_t at = index->offsets[grams[i]]; at < index->offsets[grams[i] + 1]; at++) {
+            index->hits[index->postings[at]] = 0;
+        }
+    }
+    METRIC_ADD(METRIC_FUZZY_ROWS_CHECKED, count);
+    for (size_t i = 0; i < count && ok; i++) ok = fuzzyCheck(query, contacts[candidates[i]], (int)candidates[i]);
+    free(candidates);
+    free(grams);
+    return ok;
+}
+
+// Finds contacts whose key (FUZZY_FULL_NAME..FUZZY_ADDRESS) is within maxDistance edits
+// (insertions, deletions or substitutions, ignoring case) of text, and fills matches with the
+// best limit of them: fewest edits first, then in book order. Returns how many were written.
+int findContactsFuzzy(AddressBook *book, int key, const char *text, int maxDistance, int limit, FuzzyMatch *matches) {
+    if (key < 0 || key >= FUZZY_KEY_COUNT) return 0;
+    if (maxDistance > FUZZY_MAX_DISTANCE) maxDistance = FUZZY_MAX_DISTANCE;
+    METRIC_TIMER(started);
+    FuzzyQuery query;
+    if (!fuzzyQueryInit(&query, key, text, maxDistance)) return 0;
+    FuzzyIndex *index = &book->fuzzy[key];
+    Contact **contacts = bookContacts(book);
+    int ok = -1;
+    if (!index->stale || fuzzyIndexBuild(index, contacts, book->count, key)) {
+        ok = fuzzyIndexSearch(index, &query, contacts);
+    }
+    if (ok < 0) ok = fuzzyScan(&query, contacts, book->count);
+    int count = ok ? fuzzyRank(&query, limit, matches) : 0;
+    fuzzyQueryFree(&query);
+    METRIC_TIME(METRIC_FUZZY_SEARCH, started);
+    return count;
+}
+
+// The columns and fuzzy indexes are by position, any change to the vector outdates them
+void markScanIndexesStale(AddressBook *book) {
+    book->columns.stale = 1;
+    for (int i = 0; i < FUZZY_KEY_COUNT; i++) book->fuzzy[i].stale = 1;
+}
+
+// Builds the name and phone indexes of a book whose snapshot load left them stale. Threads
+// that read the book (the parallel import) must find them built, see parseContactsParallel.
+int buildHashIndexes(AddressBook *book) {
+    if (!book->hashesStale) return 1;
+    Contact **contacts = bookContacts(book);
+    if (!hashIndexInsertMany(&book->names, contacts, book->count, NULL, nameHashOf) ||
+        !hashIndexInsertMany(&book->phones, contacts, book->count, NULL, phoneHashOf)) {
+        printf("Error: the name and phone indexes could not be built in buildHashIndexes\n");
+        hashIndexFree(&book->names);
+        hashIndexFree(&book->phones);
+        return 0;
+    }
+    book->hashesStale = 0;
+    return 1;
+}
+
+// The name index, built first if it is stale
+HashIndex *bookNames(AddressBook *book) {
+    buildHashIndexes(book);
+    return &book->names;
+}
+
+// The phone index, built first if it is stale
+HashIndex *bookPhones(AddressBook *book) {
+    buildHashIndexes(book);
+    return &book->phones;
+}
+
+// Helper function to check for duplicates
+int isDuplicate(AddressBook *book, Contact *newContact) {
+    return nameIndexFind(bookNames(book), newContact->firstName, newContact->familyName) != NULL;
+}
+
+void unmapFiles(MappedFile *mappings) {
+    while (mappings) {
+        MappedFile *next = mappings->next;
+        munmap(mappings->data, mappings->size);
+        free(mappings);
+        mappings = next;
+    }
+}
+
+void releaseStoragePin(StoragePin *pin) {
+    if (atomic_fetch_sub(&pin->refs, 1) != 1) return;
+    arenaFree(&pin->arena);
+    unmapFiles(pin->mappings);
+    free(pin);
+}
+
+// Sets up an empty address book
+int initAddressBook(AddressBook *book) {
+    book->contacts = NULL;
+    book->count = book->capacity = 0;
+    book->names.entries = NULL;
+    book->names.capacity = book->names.size = book->names.used = 0;
+    book->phones.entries = NULL;
+    book->phones.capacity = book->phones.size = book->phones.used = 0;
+    book->hashesStale = 0;
+    sortedIndexInit(&book->byFamilyName, compareContactNames, compareContactPointers, familyNameOf);
+    sortedIndexInit(&book->byFirstName, compareFirstNames, compareFirstNamePointers, firstNameOf);
+    book->storage.blocks = NULL;
+    book->compact = compactStorageEnabled();
+    book->strings.entries = NULL;
+    book->strings.capacity = book->strings.size = 0;
+    book->strings.text.blocks = NULL;
+    book->mappings = NULL;
+    book->journal = NULL;
+    book->pin = NULL;
+    memset(&book->columns, 0, sizeof(book->columns));
+    memset(book->fuzzy, 0, sizeof(book->fuzzy));
+    markScanIndexesStale(book);
+    book->order.root = NULL;
+    book->order.stale = 1;
+    book->order.sorted = -1;
+    book->contactsStale = 0;
+    return 1;
+}
+
+// Frees every contact and the book's own storage, without visiting the contacts
+void freeAddressBook(AddressBook *book) {
+    free(book->contacts);
+    book->contacts = NULL;
+    book->count = book->capacity = 0;
+    hashIndexFree(&book->names);
+    hashIndexFree(&book->phones);
+    book->hashesStale = 0;
+    sortedIndexFree(&book->byFamilyName);
+    sortedIndexFree(&book->byFirstName);
+    orderNodeFree(book->order.root);
+    book->order.root = NULL;
+    book->order.stale = 1;
+    book->order.sorted = -1;
+    book->contactsStale = 0;
+    contactColumnsFree(&book->columns);
+    for (int i = 0; i < FUZZY_KEY_COUNT; i++) fuzzyIndexFree(&book->fuzzy[i]);
+    // Contacts still read by views may point to pooled strings, which go with the rest
+    arenaAdopt(&book->storage, &book->strings.text);
+    stringPoolFree(&book->strings);
+    if (book->pin) {
+        // Published views may still read these contacts, the last reference frees them
+        book->pin->arena = book->storage;
+        book->pin->mappings = book->mappings;
+        book->storage.blocks = NULL;
+        book->mappings = NULL;
+        releaseStoragePin(book->pin);
+        book->pin = NULL;
+    } else {
+        arenaFree(&book->storage);
+        unmapFiles(book->mappings);
+        book->mappings = NULL;
+    }
+}
+
+// Pool for the strings of new contacts, NULL unless the book uses compact storage
+StringPool *bookStrings(AddressBook *book) {
+    return book->compact ? &book->strings : NULL;
+}
+
+// Adds a contact to every index of the book
+int indexContact(AddressBook *book, Contact *contact) {
+    if (!nameIndexInsert(bookNames(book), contact)) return 0;
+    if (!hashIndexReserve(&book->phones, 1)) {
+        nameIndexRemove(&book->names, contact);
+        return 0;
+    }
+    hashIndexInsertHashed(&book->phones, contact, phoneHashOf(contact));
+    sortedIndexInsert(&book->byFamilyName, contact);
+    sortedIndexInsert(&book->byFirstName, contact);
+    markScanIndexesStale(book);
+    return 1;
+}
+
+// Removes a contact from every index of the book; call it before changing an indexed field
+void unindexContact(AddressBook *book, Contact *contact) {
+    nameIndexRemove(bookNames(book), contact);
+    hashIndexRemoveHashed(&book->phones, contact, phoneHashOf(contact));
+    sortedIndexRemove(&book->byFamilyName, contact);
+    sortedIndexRemove(&book->byFirstName, contact);
+    markScanIndexesStale(book);
+}
+
+// Swaps old for contact in every index; both have the same names and phone number
+void reindexCopy(AddressBook *book, Contact *old, Contact *contact) {
+    hashIndexReplace(bookNames(book), old, contact, nameHashOf(old));
+    hashIndexReplace(&book->phones, old, contact, phoneHashOf(old));
+    sortedIndexReplace(&book->byFamilyName, old, contact);
+    sortedIndexReplace(&book->byFirstName, old, contact);
+    markScanIndexesStale(book);
+}
+
+// Bulk operations call this before adding many contacts, the sorted indexes are then rebuilt once on the next query
+void markSortedIndexesStale(AddressBook *book) {
+    book->byFamilyName.stale = 1;
+    book->byFirstName.stale = 1;
+}
+
+// Indexes a run of contacts in bulk; nameHashes may hold their precomputed full-name hashes
+int indexContactsMany(AddressBook *book, Contact **contacts, int count, const uint64_t *nameHashes) {
+    markSortedIndexesStale(book);
+    markScanIndexesStale(book);
+    return hashIndexInsertMany(bookNames(book), contacts, count, nameHashes, nameHashOf) &&
+           hashIndexInsertMany(&book->phones, contacts, count, NULL, phoneHashOf);
+}
+
+// Number of contacts in the book
+int countContacts(AddressBook *book) {
+    if (!book) return 0;
+    return book->count;
+}
+
+// Makes room for at least minCapacity contacts, growing the vector geometrically
+int reserveContacts(AddressBook *book, int minCapacity) {
+    if (minCapacity <= book->capacity) return 1;
+    int capacity = book->capacity ? book->capacity : 8;
+    while (capacity < minCapacity) capacity += capacity / 2;
+    Contact **newArray = (Contact **)realloc(book->contacts, capacity * sizeof(Contact *));
+    if (!newArray) {
+        printf("Error: Memory reallocation failed in reserveContacts\n");
+        return 0;
+    }
+    book->contacts = newArray;
+    book->capacity = capacity;
+    METRIC_ADD(METRIC_VECTOR_GROWTHS, 1);
+    return 1;
+}
+
+// The contacts vector in book order, first brought up to date from the tree if single
+// contacts were inserted or removed there since
+Contact **bookContacts(AddressBook *book) {
+    if (book->contactsStale) {
+        orderNodeFlatten(book->order.root, book->contacts);
+        book->contactsStale = 0;
+    }
+    return book->contacts;
+}
+
+Contact *bookContactAt(AddressBook *book, int position) {
+    return book->contactsStale ? orderGet(book->order.root, position) : book->contacts[position];
+}
+
+// Whether contact is ordered between the contacts at positions before and after, either of
+// which may be outside the book
+int fitsInOrder(AddressBook *book, int before, int after, const Contact *contact) {
+    if (before >= 0 && compareContactNames(bookContactAt(book, before), contact) > 0) return 0;
+    if (after < book->count && compareContactNames(contact, bookContactAt(book, after)) > 0) return 0;
+    return 1;
+}
+
+// Puts contact in place of the one at position; the caller keeps the indexes in sync
+void bookSetContactAt(AddressBook *book, int position, Contact *contact) {
+    if (!book->order.stale) orderSet(book->order.root, position, contact);
+    if (!book->contactsStale) book->contacts[position] = contact;
+    if (book->order.sorted == 1) book->order.sorted = fitsInOrder(book, position - 1, position + 1, contact);
+    else book->order.sorted = -1;
+}
+
+// Builds the tree from the vector if it is stale, so single inserts and removals stop shifting
+// the vector; 0 when it could not be built, the vector then stays in use
+int useContactOrder(AddressBook *book) {
+    if (!book->order.stale) return 1;
+    OrderNode *root = orderBuild(book->contacts, book->count);
+    if (!root) {
+        printf("Error: Memory allocation failed in useContactOrder\n");
+        return 0;
+    }
+    book->order.root = root;
+    book->order.stale = 0;
+    return 1;
+}
+
+// Bulk operations rearrange the vector itself: they call this first to bring the vector up to
+// date and drop the tree, which the next single insert or removal rebuilds
+Contact **dropContactOrder(AddressBook *book) {
+    Contact **contacts = bookContacts(book);
+    orderNodeFree(book->order.root);
+    book->order.root = NULL;
+    book->order.stale = 1;
+    book->order.sorted = -1;
+    return contacts;
+}
+
+// Checks whether the book is currently in alphabetical order; the answer is kept up to date
+// by single inserts, removals and edits, a bulk change has it checked again
+int isSortedByName(AddressBook *book) {
+    if (book->order.sorted < 0) {
+        Contact **contacts = bookContacts(book);
+        book->order.sorted = 1;
+        for (int i = 1; i < book->count; i++) {
+            if (compareContactNames(contacts[i - 1], contacts[i]) > 0) {
+                book->order.sorted = 0;
+                break;
+            }
+        }
+    }
+    return book->order.sorted;
+}
+
+// Stores a contact at position and indexes it: in the tree when there is one, otherwise by
+// shifting the tail of the vector up
+int insertContactAt(AddressBook *book, int position, Contact *newContact) {
+    if (!reserveContacts(book, book->count + 1)) return 0;
+    // An insert cannot undo a misplaced contact, so only a sorted book needs a look at the neighbours
+    int sorted = book->order.sorted == 1 ? fitsInOrder(book, position - 1, position, newContact) : book->order.sorted;
+    if (!indexContact(book, newContact)) return 0;
+    if (book->order.stale) {
+        memmove(&book->contacts[position + 1], &book->contacts[position],
+                (book->count - position) * sizeof(Contact *));
+        book->contacts[position] = newContact;
+    } else {
+        if (!orderInsert(&book->order, position, newContact)) {
+            printf("Error: Memory allocation failed in insertContactAt\n");
+            unindexContact(book, newContact);
+            return 0;
+        }
+        // The vector keeps up with appends, anything else leaves it to bookContacts
+        if (!book->contactsStale && position == book->count) book->contacts[position] = newContact;
+        else book->contactsStale = 1;
+    }
+    book->count++;
+    book->order.sorted = sorted;
+    if (book->journal) journalInsert(book->journal, position, newContact);
+    METRIC_ADD(METRIC_INSERTS, 1);
+    return 1;
+}
+
+// Unindexes and removes the contact at position, from the tree when there is one, otherwise
+// by shifting the tail of the vector down; its arena space is reclaimed when the book is freed or replaced
+void deleteContactAt(AddressBook *book, int position) {
+    METRIC_TIMER(started);
+    unindexContact(book, bookContactAt(book, position));
+    if (book->order.stale) {
+        memmove(&book->contacts[position], &book->contacts[position + 1],
+                (book->count - position - 1) * sizeof(Contact *));
+    } else {
+        orderDelete(&book->order, position);
+        if (position != book->count - 1) book->contactsStale = 1;
+    }
+    book->count--;
+    // Removing a misplaced contact may have left the book sorted
+    if (book->order.sorted == 0) book->order.sorted = -1;
+    if (book->journal) journalDelete(book->journal, position);
+    METRIC_ADD(METRIC_DELETES, 1);
+    METRIC_TIME(METRIC_REMOVE, started);
+}
+
+// Read and validate new contact details
+Contact *readNewContact(AddressBook *book) {
+    Contact *newContact = (Contact *)arenaAlloc(&book->storage, sizeof(Contact));
+    if (!newContact) {
+        printf("Error: Memory allocation failed for Contact in readNewContact\n");
+        return NULL;
+    }
+    char buffer[256];
+    int attempts;
+
+    // First name
+    printf("Enter the first name: ");
+    fgets(buffer, sizeof(buffer), stdin);
+    buffer[strcspn(buffer, "\n")] = 0;
+    newContact->firstName = storeString(&book->storage, bookStrings(book), buffer, strlen(buffer));
+    if (!newContact->firstName) {
+        printf("Error: unable to allocate memory for the first name string\n");
+        return NULL;
+    }
+
+    // Family name
+    printf("Enter the family name: ");
+    fgets(buffer, sizeof(buffer), stdin);
+    buffer[strcspn(buffer, "\n")] = 0;
+    newContact->familyName = storeString(&book->storage, bookStrings(book), buffer, strlen(buffer));
+    if (!newContact->familyName) {
+        printf("Error: unable to allocate memory for the family name string\n");
+        return NULL;
+    }
+
+    // Address
+    printf("Enter the address: ");
+    fgets(buffer, sizeof(buffer), stdin);
+    buffer[strcspn(buffer, "\n")] = 0;
+    if (!storeAddress(&book->storage, bookStrings(book), newContact, buffer, strlen(buffer))) {
+        printf("Error: unable to allocate memory for the address string\n");
+        return NULL;
+    }
+
+    // Phone number, checked like the ones of a loaded file
+    long long number = 0;
+    attempts = 0;
+    while (attempts < 5) {
+        printf("Enter 10-digit phone number that must not start with 0: ");
+        if (fgets(buffer, sizeof(buffer), stdin) && parsePhoneDigits(buffer, strcspn(buffer, "\n"), &number)) break;
+        printf("Error: Invalid phone number. Try again:\n");
+        attempts++;
+    }
+    if (attempts == 5) {
+        printf("Error: Could not read a valid phone number\n");
+        number = 0;
+    }
+    newContact->phoneNum = number;
+
+    // Age
+    attempts = 0;
+    while (attempts < 5) {
+        printf("Enter the age: ");
+        if (fgets(buffer, sizeof(buffer), stdin) && parseAgeDigits(buffer, strcspn(buffer, "\n"), &number)) break;
+        printf("Error: Invalid age. Try again:\n");
+        attempts++;
+    }
+    if (attempts == 5) {
+        printf("Error: Could not read a valid age\n");
+        number = 0;
+    }
+    newContact->age = (int)number;
+    return newContact;
+}
+
+// Appends contact to the end
+int appendContact(AddressBook *book, Contact *newContact) {
+    if (!newContact) return 0;
+    if (!insertContactAt(book, book->count, newContact)) {
+        printf("Memory reallocation error in appendContact\n");
+        return 0;
+    }
+    printf("Contact appended successfully by appendContact\n");
+    return 1;
+}
+
+// Inserts contact alphabetically: before the first contact ordered after it
+int insertContactAlphabetical(AddressBook *book, Contact *newContact) {
+    if (!newContact) return 0;
+    METRIC_TIMER(started);
+    int i;
+    if (isSortedByName(book) && useContactOrder(book)) {
+        i = orderBound(book->order.root, newContact, 1);
+    } else {
+        Contact **contacts = bookContacts(book);
+        for (i = 0; i < book->count; i++) {
+            if (compareContactNames(newContact, contacts[i]) < 0) break;
+        }
+    }
+    if (!insertContactAt(book, i, newContact)) {
+        printf("Memory reallocation error in insertContactAlphabetical\n");
+        return 0;
+    }
+    METRIC_TIME(METRIC_INSERT_ALPHABETICAL, started);
+    printf("Contact was successfully added in alphabetical order\n");
+    return 1;
+}
+
+// Removes contact by index
+int removeContactByIndex(AddressBook *book) {
+    if (!book) {
+        printf("Error: value of addressBook received in removeContactByIndex was NULL\n");
+        return 0;
+    }
+    int count = countContacts(book);
+    if (count == 0) {
+        printf("Error: Index out of range in removeContactByIndex\n");
+        return 0;
+    }
+    int index;
+    printf("Removing a contact by index\nEnter index to remove (0 based): ");
+    if (scanf("%d", &index) != 1) {
+        printf("Error: Value of index supplied could not be read.\n");
+        while (getchar() != '\n');
+        return 0;
+    }
+    while (getchar() != '\n');
+    if (index < 0 || index >= count) {
+        printf("Error: Index out of range in removeContactByIndex\n");
+        return 0;
+    }
+    useContactOrder(book);
+    deleteContactAt(book, index);
+    printf("Contact removed successfully by removeContactByIndex\n");
+    return 1;
+}
+
+// Removes contact by full name
+int removeContactByFullName(AddressBook *book) {
+    if (!book) {
+        printf("Error: value of contacts received in removeContactByFullName was NULL\n");
+        return 0;
+    }
+    char firstName[256], familyName[256];
+    printf("Enter first name: ");
+    fgets(firstName, sizeof(firstName), stdin);
+    firstName[strcspn(firstName, "\n")] = 0;
+    printf("Enter family name: ");
+    fgets(familyName, sizeof(familyName), stdin);
+    familyName[strcspn(familyName, "\n")] = 0;
+    return removeContactByName(book, firstName, familyName);
+}
+
+// Removes the first contact with this full name; 1 when removed, 2 when there is none
+int removeContactByName(AddressBook *book, const char *firstName, const char *familyName) {
+    // The index answers "not found" in O(1); a hit still needs the position of the first match
+    if (!nameIndexFind(bookNames(book), firstName, familyName)) {
+        printf("Contact '%s %s' not found\n", firstName, familyName);
+        return 2;
+    }
+    int count = countContacts(book);
+    if (isSortedByName(book) && useContactOrder(book)) {
+        // Equal names are next to each other in a sorted book, the first is at the lower bound
+        Contact key;
+        key.firstName = (char *)firstName;
+        key.familyName = (char *)familyName;
+        int i = orderBound(book->order.root, &key, 0);
+        if (i < count && compareContactNames(bookContactAt(book, i), &key) == 0) {
+            deleteContactAt(book, i);
+            printf("Contact '%s %s' removed successfully\n", firstName, familyName);
+            return 1;
+        }
+    } else {
+        Contact **contacts = bookContacts(book);
+        for (int i = 0; i < count; i++) {
+            if (strcmp(contacts[i]->firstName, firstName) == 0 &&
+                strcmp(contacts[i]->familyName, familyName) == 0) {
+                deleteContactAt(book, i);
+                printf("Contact '%s %s' removed successfully\n", firstName, familyName);
+                return 1;
+            }
+        }
+    }
+    printf("Contact '%s %s' not found\n", firstName, familyName);
+    return 2;
+}
+
+// Worker thread count: ADDRESSBOOK_THREADS when set, else one per online CPU
+int workerThreadCount(void) {
+    const char *setting = getenv("ADDRESSBOOK_THREADS");
+    long threads = setting ? strtol(setting, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > WORKER_MAX_THREADS) threads = WORKER_MAX_THREADS;
+    return (int)threads;
+}
+
+// Runs work on each of count tasks of taskSize bytes, the first one on the calling thread;
+// a task whose thread cannot be started is handled inline as well
+void runWorkers(void *tasks, size_t taskSize, int count, void *(*work)(void *)) {
+    pthread_t threads[WORKER_MAX_THREADS];
+    int started[WORKER_MAX_THREADS];
+    for (int t = 1; t < count; t++) {
+        started[t] = pthread_create(&threads[t], NULL, work, (char *)tasks + t * taskSize) == 0;
+    }
+    work(tasks);
+    for (int t = 1; t < count; t++) {
+        if (started[t]) pthread_join(threads[t], NULL);
+        else work((char *)tasks + t * taskSize);
+    }
+}
+
+// Writes length bytes, retrying short writes
+int writeAll(int fd, const char *data, size_t length) {
+    size_t written = 0;
+    while (written < length) {
+        ssize_t result = write(fd, data + written, length - written);
+        if (result < 0) return 0;
+        written += (size_t)result;
+        METRIC_ADD(METRIC_WRITE_CALLS, 1);
+        METRIC_ADD(METRIC_BYTES_WRITTEN, result);
+    }
+    return 1;
+}
+
+int outBufInit(OutBuf *buf, int fd, size_t capacity) {
+    buf->fd = fd;
+    buf->length = 0;
+    buf->capacity = capacity;
+    buf->failed = 0;
+    buf->data = (char *)malloc(capacity);
+    if (!buf->data) {
+        printf("Error: Memory allocation failed in outBufInit\n");
+        buf->capacity = 0;
+        buf->failed = 1;
+        return 0;
+    }
+    return 1;
+}
+
+void outBufFree(OutBuf *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->length = buf->capacity = 0;
+}
+
+int outBufFlush(OutBuf *buf) {
+    if (!buf->failed && buf->length > 0 && !writeAll(buf->fd, buf->data, buf->length)) buf->failed = 1;
+    buf->length = 0;
+    return !buf->failed;
+}
+
+// Room for size more bytes at the end of the buffer: a buffer with a file is flushed first,
+// a collecting one (or a text longer than the buffer) grows. NULL once the buffer failed.
+char *outBufReserve(OutBuf *buf, size_t size) {
+    if (buf->failed) return NULL;
+    if (buf->capacity - buf->length >= size) return buf->data + buf->length;
+    if (buf->fd >= 0 && !outBufFlush(buf)) return NULL;
+    if (buf->capacity - buf->length < size) {
+        size_t capacity = buf->capacity * 2 > buf->length + size ? buf->capacity * 2 : buf->length + size;
+        char *grown = (char *)realloc(buf->data, capacity);
+        if (!grown) {
+            printf("Error: Memory allocation failed in outBufReserve\n");
+            buf->failed = 1;
+            return NULL;
+        }
+        buf->data = grown;
+        buf->capacity = capacity;
+        METRIC_ADD(METRIC_OUTPUT_GROWTHS, 1);
+    }
+    return buf->data + buf->length;
+}
+
+void outBufPut(OutBuf *buf, const char *text, size_t length) {
+    char *out = outBufReserve(buf, length);
+    if (!out) return;
+    memcpy(out, text, length);
+    buf->length += length;
+}
+
+// Decimal text of value (what printf's %lld gives) at out, returns its length (at most 20)
+size_t formatInteger(char *out, long long value) {
+    static const char digitPairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+    char digits[20];
+    char *cursor = digits + sizeof(digits);
+    unsigned long long magnitude = value < 0 ? 0 - (unsigned long long)value : (unsigned long long)value;
+    while (magnitude >= 100) {
+        cursor -= 2;
+        memcpy(cursor, digitPairs + (magnitude % 100) * 2, 2);
+        magnitude /= 100;
+    }
+    if (magnitude >= 10) {
+        cursor -= 2;
+        memcpy(cursor, digitPairs + magnitude * 2, 2);
+    } else {
+        *--cursor = (char)('0' + magnitude);
+    }
+    size_t length = 0;
+    if (value < 0) out[length++] = '-';
+    memcpy(out + length, cursor, digits + sizeof(digits) - cursor);
+    return length + (digits + sizeof(digits) - cursor);
+}
+
+char *putText(char *out, const char *text, size_t length) {
+    memcpy(out, text, length);
+    return out + length;
+}
+
+// Appends one contact in the given layout, number is its position in a listing
+void outBufPutContact(OutBuf *buf, Contact *contact, int number, int format) {
+    size_t firstLength = strlen(contact->firstName);
+    size_t familyLength = strlen(contact->familyName);
+    size_t addressLength = strlen(contact->address);
+    char *out = outBufReserve(buf, firstLength + familyLength + ADDRESS_NUMBER_SIZE + addressLength + 96);
+    if (!out) return;
+    char *start = out;
+    if (format == CONTACT_FORMAT_SAVE) {
+        out = putText(out, contact->firstName, firstLength);
+        *out++ = '\n';
+        out = putText(out, contact->familyName, familyLength);
+        *out++ = '\n';
+        out += formatAddressNumber(out, contact);
+        out = putText(out, contact->address, addressLength);
+        *out++ = '\n';
+        out += formatInteger(out, contact->phoneNum);
+        *out++ = '\n';
+        out += formatInteger(out, contact->age);
+        *out++ = '\n';
+    } else {
+        out += formatInteger(out, number);
+        out = putText(out, ". ", 2);
+        out = putText(out, contact->firstName, firstLength);
+        *out++ = ' ';
+        out = putText(out, contact->familyName, familyLength);
+        out = putText(out, "\nPhone: ", 8);
+        out += formatInteger(out, contact->phoneNum);
+        out = putText(out, "\nAddress: ", 10);
+        out += formatAddressNumber(out, contact);
+        out = putText(out, contact->address, addressLength);
+        out = putText(out, "\nAge: ", 6);
+        out += formatInteger(out, contact->age);
+        *out++ = '\n';
+        if (format == CONTACT_FORMAT_REPORT) *out++ = '\n';
+    }
+    buf->length += out - start;
+}
+
+void *formatChunk(void *arg) {
+    FormatChunk *chunk = (FormatChunk *)arg;
+    for (int i = 0; i < chunk->count; i++) {
+        outBufPutContact(&chunk->out, chunk->contacts[i], chunk->firstNumber + i, chunk->format);
+    }
+    return NULL;
+}
+
+// Appends count contacts numbered from 1. Large runs are formatted by the worker threads in
+// rounds of OUTPUT_PARALLEL_CHUNK contacts per thread, each into its own buffer, and the
+// buffers are written in order after every round, so the bytes match a sequential pass.
+int writeContacts(OutBuf *out, Contact **contacts, int count, int format) {
+    int threads = workerThreadCount();
+    if (count / OUTPUT_PARALLEL_CHUNK < threads) threads = count / OUTPUT_PARALLEL_CHUNK;
+    FormatChunk *chunks = threads > 1 ? (FormatChunk *)calloc(threads, sizeof(FormatChunk)) : NULL;
+    int ready = chunks != NULL;
+    for (int t = 0; ready && t < threads; t++) {
+        ready = outBufInit(&chunks[t].out, -1, OUTPUT_BUFFER_SIZE);
+    }
+    if (!ready) {
+        // One thread, or the buffers could not be set up
+        if (chunks) {
+            for (int t = 0; t < threads; t++) outBufFree(&chunks[t].out);
+            free(chunks);
+        }
+        for (int i = 0; i < count; i++) outBufPutContact(out, contacts[i], i + 1, format);
+        return !out->failed;
+    }
+    for (int done = 0; done < count && !out->failed;) {
+        int running = 0;
+        for (; running < threads && done < count; running++) {
+            FormatChunk *chunk = &chunks[running];
+            chunk->contacts = contacts + done;
+            chunk->count = count - done < OUTPUT_PARALLEL_CHUNK ? count - done : OUTPUT_PARALLEL_CHUNK;
+            chunk->firstNumber = done + 1;
+            chunk->format = format;
+            chunk->out.length = 0;
+            done += chunk->count;
+        }
+        runWorkers(chunks, sizeof(FormatChunk), running, formatChunk);
+        outBufFlush(out);
+        for (int t = 0; t < running; t++) {
+            if (chunks[t].out.failed || (!out->failed && !writeAll(out->fd, chunks[t].out.data, chunks[t].out.length))) {
+                out->failed = 1;
+            }
+        }
+    }
+    for (int t = 0; t < threads; t++) outBufFree(&chunks[t].out);
+    free(chunks);
+    return !out->failed;
+}
+
+// Numbered listing of contacts on stdout, shared by the list and search options
+void printContactList(Contact **contacts, int count) {
+    OutBuf out;
+    fflush(stdout);
+    if (outBufInit(&out, STDOUT_FILENO, OUTPUT_BUFFER_SIZE)) {
+        writeContacts(&out, contacts, count, CONTACT_FORMAT_LIST);
+        outBufFlush(&out);
+    }
+    outBufFree(&out);
+}
+
+// Lists all contacts
+void listContacts(AddressBook *book) {
+    int count = countContacts(book);
+    if (count == 0) {
+        printf("No contacts available.\n");
+        return;
+    }
+    METRIC_TIMER(started);
+    printContactList(bookContacts(book), count);
+    METRIC_TIME(METRIC_LIST, started);
+}
+
+// Collects every contact with this phone number (in no particular order)
+int findContactsByPhone(AddressBook *book, long long phoneNum, ContactBatch *results) {
+    HashIndex *index = bookPhones(book);
+    if (index->capacity == 0) return 0;
+    METRIC_TIMER(started);
+    unsigned long long hash = hashPhone(phoneNum);
+    size_t mask = index->capacity - 1;
+    int found = 0;
+    for (size_t i = (size_t)hash & mask; index->entries[i].contact != NULL; i = (i + 1) & mask) {
+        Contact *contact = index->entries[i].contact;
+        if (contact != HASH_INDEX_TOMBSTONE && index->entries[i].hash == hash && contact->phoneNum == phoneNum) {
+            if (!addToBatch(results, contact)) break;
+            found++;
+        }
+    }
+    METRIC_TIME(METRIC_FIND_PHONE, started);
+    return found;
+}
+
+// Collects every contact whose family name (or first name) starts with prefix, alphabetically
+int findContactsByPrefix(AddressBook *book, const char *prefix, int byFirstName, ContactBatch *results) {
+    METRIC_TIMER(started);
+    SortedIndex *index = byFirstName ? &book->byFirstName : &book->byFamilyName;
+    if (index->stale && !sortedIndexRebuild(index, bookContacts(book), book->count)) return 0;
+    int found = sortedIndexFindPrefix(index, prefix, results);
+    METRIC_TIME(METRIC_FIND_PREFIX, started);
+    return found;
+}
+
+// Lists the contacts found by a query
+void listMatches(ContactBatch *results) {
+    if (results->count == 0) {
+        printf("No matching contacts.\n");
+        return;
+    }
+    printContactList(results->items, results->count);
+}
+
+// Prints the summary of a filter query
+void printAggregate(const ContactAggregate *aggregate) {
+    printf("Matching contacts: %lld\n", aggregate->count);
+    if (aggregate->count > 0) {
+        printf("Average age: %.2f, youngest: %d, oldest: %d\n", (double)aggregate->ageSum / aggregate->count,
+               aggregate->minAge, aggregate->maxAge);
+    }
+}
+
+// Files are written under a new tempPath next to filename and only renamed over filename once
+// complete and on disk, so a crash while saving leaves the previous file intact. The temporary
+// file is always created, never truncated: an existing file (a snapshot the book is mapped
+// from, or another process's save) is left alone. Returns the descriptor, -1 on failure.
+int createTempFile(char *tempPath, const char *filename, const char *caller) {
+    static atomic_uint saves;
+    for (int attempt = 0; attempt < 100; attempt++) {
+        if (snprintf(tempPath, PATH_MAX, "%s.%ld.%u.tmp", filename, (long)getpid(),
+                     atomic_fetch_add(&saves, 1)) >= PATH_MAX) {
+            printf("Error: filename too long in %s\n", caller);
+            return -1;
+        }
+        int fd = open(tempPath, O_RDWR | O_CREAT | O_EXCL, 0666);
+        if (fd >= 0 || errno != EEXIST) {
+            if (fd < 0) printf("Error: file not opened in %s\n", caller);
+            return fd;
+        }
+    }
+    printf("Error: file not opened in %s\n", caller);
+    return -1;
+}
+
+// Renames the written and synced tempPath over filename, or removes it when the write failed
+int replaceWithTempFile(const char *tempPath, const char *filename, int ok, const char *caller) {
+    if (!ok) {
+        unlink(tempPath);
+        return 0;
+    }
+    if (rename(tempPath, filename) != 0) {
+        printf("Error: %s could not be replaced in %s\n", filename, caller);
+        unlink(tempPath);
+        return 0;
+    }
+    // Sync the directory too so the rename itself survives a crash
+    const char *slash = strrchr(filename, '/');
+    char directory[PATH_MAX];
+    if (!slash) {
+        strcpy(directory, ".");
+    } else {
+        size_t length = slash == filename ? 1 : (size_t)(slash - filename);
+        memcpy(directory, filename, length);
+        directory[length] = 0;
+    }
+    int fd = open(directory, O_RDONLY);
+    if (fd >= 0) {
+        if (fsync(fd) == 0) METRIC_ADD(METRIC_FSYNCS, 1);
+        close(fd);
+    }
+    return 1;
+}
+
+// Writes contacts in the input file format; caller names the public function in error messages
+int writeContactFile(Contact **contacts, int count, char *filename, const char *caller) {
+    char tempPath[PATH_MAX];
+    int fd = createTempFile(tempPath, filename, caller);
+    if (fd < 0) return 0;
+    OutBuf out;
+    int ok = outBufInit(&out, fd, OUTPUT_BUFFER_SIZE) &&
+             writeContacts(&out, contacts, count, CONTACT_FORMAT_SAVE) &&
+             outBufFlush(&out) && fsync(fd) == 0;
+    outBufFree(&out);
+    if (close(fd) != 0) ok = 0;
+    if (!ok) printf("Error: writing failed in %s\n", caller);
+    else METRIC_ADD(METRIC_FSYNCS, 1);
+    return replaceWithTempFile(tempPath, filename, ok, caller);
+}
+
+// Writes the human-readable report of contacts
+void writeContactReport(Contact **contacts, int count, char *filename, const char *caller) {
+    char tempPath[PATH_MAX];
+    int fd = createTempFile(tempPath, filename, caller);
+    if (fd < 0) return;
+    OutBuf out;
+    int ok = outBufInit(&out, fd, OUTPUT_BUFFER_SIZE);
+    if (ok) {
+        outBufPut(&out, "Address Book Report\n\n", 21);
+        ok = writeContacts(&out, contacts, count, CONTACT_FORMAT_REPORT);
+        char *total = outBufReserve(&out, 40);
+        if (total) {
+            char *end = putText(total, "Total Contacts: ", 16);
+            end += formatInteger(end, count);
+            *end++ = '\n';
+            out.length += end - total;
+        }
+        ok = ok && total && outBufFlush(&out) && fsync(fd) == 0;
+    }
+    outBufFree(&out);
+    if (close(fd) != 0) ok = 0;
+    if (!ok) printf("Error: writing failed in %s\n", caller);
+    else METRIC_ADD(METRIC_FSYNCS, 1);
+    replaceWithTempFile(tempPath, filename, ok, caller);
+}
+
+// Saves the contacts to file (input format)
+int saveContactsToFile(AddressBook *book, char *filename) {
+    if (!filename) {
+        printf("Error: filename formal parameter passed value NULL in saveContactsToFile\n");
+        return 0;
+    }
+    if (!book) {
+        printf("Error: addressBook formal parameter passed value NULL in saveContactsToFile\n");
+        return 0;
+    }
+    METRIC_TIMER(started);
+    int ok = writeContactFile(bookContacts(book), countContacts(book), filename, "saveContactsToFile");
+    METRIC_TIME(METRIC_SAVE, started);
+    return ok;
+}
+
+// Print contacts to file (human-readable)
+void printContactsToFile(AddressBook *book, char *filename) {
+    if (!filename) {
+        printf("Error: filename formal parameter passed value NULL in printContactsToFile\n");
+        return;
+    }
+    if (!book) {
+        printf("Error: addressBook formal parameter passed value NULL in printContactsToFile\n");
+        return;
+    }
+    METRIC_TIMER(started);
+    writeContactReport(bookContacts(book), countContacts(book), filename, "printContactsToFile");
+    METRIC_TIME(METRIC_PRINT, started);
+}
+
+// Parses a decimal integer field the way "%lld" would, ignoring anything after the digits;
+// values beyond the range of long long are clamped to it like strtoll does
+long long parseNumberField(const char *text, const char *end) {
+    while (text < end && (*text == ' ' || *text == '\t' || *text == '\r')) text++;
+    int negative = 0;
+    if (text < end && (*text == '-' || *text == '+')) negative = *text++ == '-';
+    unsigned long long limit = negative ? (unsigned long long)LLONG_MAX + 1 : LLONG_MAX;
+    unsigned long long value = 0;
+    for (; text < end && *text >= '0' && *text <= '9'; text++) {
+        unsigned digit = *text - '0';
+        value = value > (limit - digit) / 10 ? limit : value * 10 + digit;
+    }
+    if (!negative) return (long long)value;
+    return value > LLONG_MAX ? LLONG_MIN : -(long long)value;
+}
+
+void lineScannerInit(LineScanner *scanner, const char *data, const char *end) {
+    scanner->next = data;
+    scanner->end = end;
+    scanner->base = data;
+    scanner->mask = 0;
+}
+
+// The next newline, or NULL when there is none before the end. The last 63 bytes or fewer
+// are left to memchr so no load reads past the end.
+const char *lineScannerNext(LineScanner *scanner) {
+    while (scanner->mask == 0) {
+        const char *next = scanner->next;
+        if (next >= scanner->end) return NULL;
+#ifdef __SSE2__
+        if (scanner->end - next >= 64) {
+            const __m128i newline = _mm_set1_epi8('\n');
+            uint64_t mask = 0;
+            for (int i = 0; i < 4; i++) {
+                __m128i bytes = _mm_loadu_si128((const __m128i *)(next + 16 * i));
+                mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)) << (16 * i);
+            }
+            scanner->base = next;
+            scanner->mask = mask;
+            scanner->next = next + 64;
+            continue;
+        }
+#endif
+        const char *newline = (const char *)memchr(next, '\n', scanner->end - next);
+        scanner->next = newline ? newline + 1 : scanner->end;
+        return newline;
+    }
+    const char *newline = scanner->base + __builtin_ctzll(scanner->mask);
+    scanner->mask &= scanner->mask - 1;
+    return newline;
+}
+
+// Drops the spaces, tabs and carriage returns around a field
+void trimField(const char **text, size_t *length) {
+    while (*length > 0 && (**text == ' ' || **text == '\t' || **text == '\r')) (*text)++, (*length)--;
+    while (*length > 0 && ((*text)[*length - 1] == ' ' || (*text)[*length - 1] == '\t' ||
+                           (*text)[*length - 1] == '\r')) (*length)--;
+}
+
+// Ten digits not starting with 0, the phone numbers readNewContact accepts. Eight of the
+// digits are checked and converted at once in a 64-bit word.
+int parsePhoneDigits(const char *text, size_t length, long long *value) {
+    trimField(&text, &length);
+    if (length != 10 || text[0] < '1' || text[0] > '9' || text[8] < '0' || text[8] > '9' ||
+        text[9] < '0' || text[9] > '9') {
+        return 0;
+    }
+    uint64_t high;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t word;
+    memcpy(&word, text, 8);
+    // Every byte is 0x30..0x39: its high nibble is 3 before and after adding 6
+    if ((word & 0xF0F0F0F0F0F0F0F0ULL) != 0x3030303030303030ULL ||
+        ((word + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) != 0x3030303030303030ULL) {
+        return 0;
+    }
+    // Pairs, then fours, then all eight digits, the first digit being the lowest byte
+    word -= 0x3030303030303030ULL;
+    word = (word * 10 + (word >> 8)) & 0x00FF00FF00FF00FFULL;
+    word = (word * 100 + (word >> 16)) & 0x0000FFFF0000FFFFULL;
+    high = (word * 10000 + (word >> 32)) & 0xFFFFFFFFULL;
+#else
+    high = 0;
+    for (int i = 0; i < 8; i++) {
+        if (text[i] < '0' || text[i] > '9') return 0;
+        high = high * 10 + (text[i] - '0');
+    }
+#endif
+    *value = (long long)(high * 100 + (text[8] - '0') * 10 + (text[9] - '0'));
+    return 1;
+}
+
+// Age from 1 to 150, the ages readNewContact accepts
+int parseAgeDigits(const char *text, size_t length, long long *value) {
+    trimField(&text, &length);
+    if (length == 0 || length > 3) return 0;
+    long long age = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] < '0' || text[i] > '9') return 0;
+        age = age * 10 + (text[i] - '0');
+    }
+    if (age < 1 || age > 150) return 0;
+    *value = age;
+    return 1;
+}
+
+// A decimal integer from min to max with an optional sign, as the file writer prints any
+// value; 0 for anything else (other characters, junk after the digits, or overflow)
+int parseWholeNumber(const char *text, size_t length, long long min, long long max, long long *value) {
+    trimField(&text, &length);
+    size_t i = 0;
+    int negative = 0;
+    if (length > 0 && (text[0] == '-' || text[0] == '+')) negative = text[i++] == '-';
+    if (i == length) return 0;
+    unsigned long long limit = negative ? (unsigned long long)-(min + 1) + 1 : (unsigned long long)max;
+    unsigned long long number = 0;
+    for (; i < length; i++) {
+        if (text[i] < '0' || text[i] > '9') return 0;
+        unsigned digit = text[i] - '0';
+        if (number > (limit - digit) / 10) return 0;
+        number = number * 10 + digit;
+    }
+    *value = negative && number > 0 ? -(long long)(number - 1) - 1 : (long long)number;
+    return 1;
+}
+
+// Reads the phone number or age of a record: 1 when readNewContact would accept it (or it is 0,
+// stored when nothing valid was entered), 2 for another whole number, which older builds could
+// write, and 0 when it is not a number
+int parseRecordNumber(const char *text, size_t length, int field, long long *value) {
+    int phone = field == CONTACT_FIELD_PHONE;
+    if (phone ? parsePhoneDigits(text, length, value) : parseAgeDigits(text, length, value)) return 1;
+    if (!parseWholeNumber(text, length, phone ? LLONG_MIN : INT_MIN, phone ? LLONG_MAX : INT_MAX, value)) return 0;
+    return *value == 0 ? 1 : 2;
+}
+
+// Notes a field in the report; skipped says whether its record was dropped or loaded
+void noteParseProblem(ParseReport *report, long long line, int field, int skipped) {
+    long long noted = report->malformed + report->outOfRange;
+    if (noted < PARSE_REPORT_LINES) {
+        report->lines[noted] = line;
+        report->fields[noted] = field;
+        report->skipped[noted] = skipped;
+    }
+    if (skipped) report->malformed++;
+    else report->outOfRange++;
+}
+
+// Adds what was noted in a later part of the same file
+void mergeParseReport(ParseReport *report, const ParseReport *later) {
+    long long listed = later->malformed + later->outOfRange;
+    if (listed > PARSE_REPORT_LINES) listed = PARSE_REPORT_LINES;
+    long long skipped = 0;
+    for (long long i = 0; i < listed; i++) {
+        noteParseProblem(report, later->lines[i], later->fields[i], later->skipped[i]);
+        skipped += later->skipped[i];
+    }
+    report->malformed += later->malformed - skipped;
+    report->outOfRange += later->outOfRange - (listed - skipped);
+}
+
+void printParseReport(const ParseReport *report) {
+    long long listed = report->malformed + report->outOfRange;
+    if (listed > PARSE_REPORT_LINES) listed = PARSE_REPORT_LINES;
+    long long skipped = 0;
+    for (long long i = 0; i < listed; i++) {
+        const char *name = report->fields[i] == CONTACT_FIELD_PHONE ? "phone number" : "age";
+        if (report->skipped[i]) {
+            printf("Error: contact record skipped, the %s on line %lld is not a number\n", name, report->lines[i]);
+            skipped++;
+        } else {
+            printf("Warning: the %s on line %lld is out of range (%s), it was loaded as it is\n", name, report->lines[i],
+                   report->fields[i] == CONTACT_FIELD_PHONE ? "10 digits, no leading 0" : "1 to 150");
+        }
+    }
+    if (report->malformed > skipped) {
+        printf("Error: %lld more malformed contact records skipped\n", report->malformed - skipped);
+    }
+    if (report->outOfRange > listed - skipped) {
+        printf("Warning: %lld more phone numbers or ages out of range were loaded\n",
+               report->outOfRange - (listed - skipped));
+    }
+}
+
+// Parses records of the input file format (first name, family name, address, phone, age;
+// one per line) from data into contacts allocated, strings included, from arena; with a
+// pool (compact storage) the strings are shared through it.
+// Lines are found with a LineScanner and have no length limit. Records whose phone number
+// or age is not a number are skipped, and out-of-range ones loaded as they are; both are
+// noted in report, which numbers the lines from report->line.
+int parseContactRecords(const char *data, size_t size, Arena *arena, StringPool *strings, ContactBatch *batch,
+                        ParseReport *report) {
+    int first = batch->count;
+    METRIC_ADD(METRIC_BYTES_PARSED, size);
+    const char *cursor = data;
+    const char *end = data + size;
+    long long line = report->line;
+    LineScanner scanner;
+    lineScannerInit(&scanner, data, end);
+    for (; cursor < end; line += 5) {
+        const char *lines[5];
+        size_t lengths[5];
+        int lineCount = 0;
+        for (; lineCount < 5 && cursor < end; lineCount++) {
+            const char *newline = lineScannerNext(&scanner);
+            const char *lineEnd = newline ? newline : end;
+            lines[lineCount] = cursor;
+            lengths[lineCount] = lineEnd - cursor;
+            cursor = newline ? newline + 1 : end;
+        }
+        if (lineCount < 5) {
+            // Trailing blank lines are fine, anything else is an incomplete record
+            int blank = 1;
+            for (int i = 0; i < lineCount; i++) {
+                for (size_t j = 0; j < lengths[i]; j++) {
+                    if (lines[i][j] != ' ' && lines[i][j] != '\t' && lines[i][j] != '\r') blank = 0;
+                }
+            }
+            if (!blank) printf("Error: incomplete contact record at line %lld at the end of the file was skipped\n", line);
+            break;
+        }
+        long long phoneNum = 0, age = 0;
+        int phoneRead = parseRecordNumber(lines[3], lengths[3], CONTACT_FIELD_PHONE, &phoneNum);
+        int ageRead = phoneRead ? parseRecordNumber(lines[4], lengths[4], CONTACT_FIELD_AGE, &age) : 0;
+        if (!phoneRead || !ageRead) {
+            noteParseProblem(report, phoneRead ? line + 4 : line + 3, phoneRead ? CONTACT_FIELD_AGE : CONTACT_FIELD_PHONE, 1);
+            continue;
+        }
+        if (phoneRead == 2) noteParseProblem(report, line + 3, CONTACT_FIELD_PHONE, 0);
+        if (ageRead == 2) noteParseProblem(report, line + 4, CONTACT_FIELD_AGE, 0);
+        Contact *contact;
+        if (strings) {
+            contact = (Contact *)arenaAlloc(arena, sizeof(Contact));
+            if (!contact) return 0;
+            contact->firstName = storeString(arena, strings, lines[0], lengths[0]);
+            contact->familyName = storeString(arena, strings, lines[1], lengths[1]);
+            storeAddress(arena, strings, contact, lines[2], lengths[2]);
+        } else {
+            // The contact and its three strings in one allocation
+            contact = (Contact *)arenaAlloc(arena, sizeof(Contact) + lengths[0] + lengths[1] + lengths[2] + 3);
+            if (!contact) return 0;
+            char *firstName = (char *)(contact + 1);
+            char *familyName = firstName + lengths[0] + 1;
+            char *address = familyName + lengths[1] + 1;
+            memcpy(firstName, lines[0], lengths[0]);
+            firstName[lengths[0]] = 0;
+            memcpy(familyName, lines[1], lengths[1]);
+            familyName[lengths[1]] = 0;
+            memcpy(address, lines[2], lengths[2]);
+            address[lengths[2]] = 0;
+            contact->firstName = firstName;
+            contact->familyName = familyName;
+            contact->address = address;
+            contact->addressNumber = 0;
+        }
+        contact->phoneNum = phoneNum;
+        contact->age = (int)age;
+        if (!contact->firstName || !contact->familyName || !contact->address || !addToBatch(batch, contact)) {
+            return 0;
+        }
+    }
+    report->line = line;
+    METRIC_ADD(METRIC_RECORDS_PARSED, batch->count - first);
+    return 1;
+}
+
+// Counting pass: newlines in the chunk
+void *countChunkLines(void *arg) {
+    ImportChunk *chunk = (ImportChunk *)arg;
+    LineScanner scanner;
+    lineScannerInit(&scanner, chunk->begin, chunk->end);
+    size_t lines = 0;
+    while (lineScannerNext(&scanner)) lines++;
+    chunk->lines = lines;
+    return NULL;
+}
+
+// Parsing pass: records of the chunk into its own arena, then the ones whose names are
+// already in the book are dropped (the book is only read while the threads run)
+void *parseChunk(void *arg) {
+    ImportChunk *chunk = (ImportChunk *)arg;
+    chunk->ok = parseContactRecords(chunk->begin, chunk->end - chunk->begin, &chunk->arena, chunk->strings, &chunk->batch,
+                                    &chunk->report);
+    if (chunk->existing && chunk->existing->count > 0) {
+        int kept = 0;
+        for (int i = 0; i < chunk->batch.count; i++) {
+            if (!isDuplicate(chunk->existing, chunk->batch.items[i])) chunk->batch.items[kept++] = chunk->batch.items[i];
+        }
+        // Counted once per chunk, an atomic add per record would be shared by all the threads
+        METRIC_ADD(METRIC_DUPLICATE_CHECKS, chunk->batch.count);
+        METRIC_ADD(METRIC_DUPLICATES_FOUND, chunk->batch.count - kept);
+        chunk->batch.count = kept;
+    }
+    return NULL;
+}
+
+// Parses the file contents on several threads. The data is cut into byte ranges moved to
+// line starts, a counting pass plus prefix sums gives the line number each range starts at,
+// and every start is then moved to the next record (multiple of five lines). Each thread
+// parses its records into a private arena that the book adopts afterwards, and the batches
+// are concatenated in file order, so the result is the one of a sequential parse.
+// With dropExisting and more than one thread, contacts whose names are already in the book
+// are left out by the parsing threads (on one thread the caller's own check is as cheap);
+// duplicates within the file are always the caller's job since they depend on file order.
+int parseContactsParallel(const char *data, size_t size, AddressBook *book, int dropExisting, ContactBatch *batch) {
+    int threads = workerThreadCount();
+    if ((size_t)threads > size / IMPORT_MIN_CHUNK) threads = size / IMPORT_MIN_CHUNK > 0 ? (int)(size / IMPORT_MIN_CHUNK) : 1;
+    ImportChunk *chunks = (ImportChunk *)calloc(threads, sizeof(ImportChunk));
+    if (!chunks) {
+        printf("Error: Memory allocation failed in parseContactsParallel\n");
+        return 0;
+    }
+    const char *end = data + size;
+    // The threads read the name index of the book, it must not be built while they run
+    if (dropExisting && threads > 1) buildHashIndexes(book);
+    for (int t = 0; t < threads; t++) {
+        const char *begin = data + (size / threads) * t;
+        if (t > 0) {
+            const char *newline = (const char *)memchr(begin - 1, '\n', end - (begin - 1));
+            begin = newline ? newline + 1 : end;
+            chunks[t - 1].end = begin;
+        }
+        chunks[t].begin = begin;
+        chunks[t].existing = dropExisting && threads > 1 ? book : NULL;
+        // A single thread can share the book's own pool, several each fill their own
+        chunks[t].strings = !book->compact ? NULL : threads == 1 ? &book->strings : &chunks[t].pool;
+        chunks[t].report.line = 1;
+    }
+    chunks[threads - 1].end = end;
+    if (threads > 1) {
+        runWorkers(chunks, sizeof(ImportChunk), threads, countChunkLines);
+        size_t line = 0;
+        for (int t = 0; t < threads; t++) {
+            const char *begin = chunks[t].begin;
+            size_t skip = (5 - line % 5) % 5;
+            chunks[t].report.line = (long long)(line + skip) + 1;
+            for (; skip > 0 && begin < end; skip--) {
+                const char *newline = (const char *)memchr(begin, '\n', end - begin);
+                begin = newline ? newline + 1 : end;
+            }
+            line += chunks[t].lines;
+            chunks[t].begin = begin;
+            if (t > 0) chunks[t - 1].end = begin;
+        }
+    }
+    runWorkers(chunks, sizeof(ImportChunk), threads, parseChunk);
+
+    int ok = 1;
+    int total = batch->count;
+    ParseReport report = {1, 0, 0, {0}, {0}, {0}};
+    for (int t = 0; t < threads; t++) {
+        ok = ok && chunks[t].ok;
+        total += chunks[t].batch.count;
+        mergeParseReport(&report, &chunks[t].report);
+    }
+    printParseReport(&report);
+    if (threads == 1 && batch->count == 0) {
+        // Nothing to concatenate, the chunk's batch is the result
+        free(batch->items);
+        *batch = chunks[0].batch;
+        chunks[0].batch.items = NULL;
+        chunks[0].batch.count = 0;
+    } else if (total > batch->capacity) {
+        Contact **items = (Contact **)realloc(batch->items, total * sizeof(Contact *));
+        if (items) {
+            batch->items = items;
+            batch->capacity = total;
+        } else {
+            printf("Error: Memory allocation failed in parseContactsParallel\n");
+            ok = 0;
+        }
+    }
+    for (int t = 0; t < threads; t++) {
+        if (batch->capacity >= total && chunks[t].batch.count > 0) {
+            memcpy(batch->items + batch->count, chunks[t].batch.items, chunks[t].batch.count * sizeof(Contact *));
+            batch->count += chunks[t].batch.count;
+        }
+        arenaAdopt(&book->storage, &chunks[t].arena);
+        if (chunks[t].strings == &chunks[t].pool) {
+            // Later contacts then share these strings too
+            stringPoolAdopt(&book->strings, &chunks[t].pool);
+            stringPoolFree(&chunks[t].pool);
+        }
+        free(chunks[t].batch.items);
+    }
+    free(chunks);
+    return ok;
+}
+
+// Maps a whole input file read-only, or reads it into memory when it cannot be mapped (pipes
+// and the like). An empty file gives data NULL. caller names the public function in error
+// messages; release the bytes with releaseInputFile.
+int openInputFile(char *filename, char **data, size_t *size, int *mapped, const char *caller) {
+    *data = NULL;
+    *size = 0;
+    *mapped = 0;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: file not opened in %s\n", caller);
+        return 0;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        printf("Error: file not opened in %s\n", caller);
+        close(fd);
+        return 0;
+    }
+    if (S_ISREG(info.st_mode)) {
+        if (info.st_size == 0) {
+            close(fd);
+            return 1;
+        }
+        char *bytes = (char *)mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (bytes != MAP_FAILED) {
+            madvise(bytes, (size_t)info.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            *data = bytes;
+            *size = (size_t)info.st_size;
+            *mapped = 1;
+            return 1;
+        }
+    }
+    size_t capacity = 1 << 16;
+    size_t length = 0;
+    char *bytes = (char *)malloc(capacity);
+    ssize_t got;
+    while (bytes && (got = read(fd, bytes + length, capacity - length)) > 0) {
+        length += (size_t)got;
+        if (length == capacity) {
+            char *grown = (char *)realloc(bytes, capacity * 2);
+            if (!grown) {
+                free(bytes);
+                bytes = NULL;
+                break;
+            }
+            bytes = grown;
+            capacity *= 2;
+        }
+    }
+    close(fd);
+    if (!bytes) {
+        printf("Error: Memory allocation failed in %s\n", caller);
+        return 0;
+    }
+    *data = bytes;
+    *size = length;
+    return 1;
+}
+
+void releaseInputFile(char *data, size_t size, int mapped) {
+    if (mapped) munmap(data, size);
+    else free(data);
+}
+
+// Shared loader: reads the file and parses every record into the book's arena, see
+// parseContactsParallel for dropExisting. caller names the public function in error messages.
+int readContactFile(char *filename, AddressBook *book, ContactBatch *batch, int dropExisting, const char *caller) {
+    char *data;
+    size_t size;
+    int mapped;
+    if (!openInputFile(filename, &data, &size, &mapped, caller)) return 0;
+    if (!data) return 1;
+    METRIC_TIMER(started);
+    int ok = parseContactsParallel(data, size, book, dropExisting, batch);
+    METRIC_TIME(METRIC_PARSE, started);
+    releaseInputFile(data, size, mapped);
+    return ok;
+}
+
+// Load contacts from file (replace existing). The file is read into a new book first, so if
+// it cannot be read or indexed the current contacts (and a journal's base file) stay as they were.
+int loadContactsFromFile(AddressBook *book, char *filename) {
+    METRIC_TIMER(started);
+    AddressBook loaded;
+    if (!initAddressBook(&loaded)) return 0;
+    ContactBatch batch = {NULL, 0, 0};
+    if (!readContactFile(filename, &loaded, &batch, 0, "loadContactsFromFile") ||
+        (batch.count > 0 && !indexContactsMany(&loaded, batch.items, batch.count, NULL))) {
+        printf("Error: the contacts were left unchanged in loadContactsFromFile\n");
+        free(batch.items);
+        freeAddressBook(&loaded);
+        return 0;
+    }
+    if (batch.count > 0) {
+        // The batch array becomes the book's vector as is
+        loaded.contacts = batch.items;
+        loaded.count = batch.count;
+        loaded.capacity = batch.capacity;
+    } else {
+        free(batch.items);
+    }
+    Journal *journal = book->journal;
+    book->journal = NULL;
+    freeAddressBook(book);
+    *book = loaded;
+    // A replaced book is not worth journaling record by record, it becomes the new base
+    book->journal = journal;
+    if (journal) compactJournal(book);
+    METRIC_TIME(METRIC_LOAD, started);
+    return book->count;
+}
+
+// Appends contacts from file
+int appendContactsFromFile(AddressBook *book, char *filename) {
+    METRIC_TIMER(started);
+    ContactBatch batch = {NULL, 0, 0};
+    int added = 0;
+    readContactFile(filename, book, &batch, 1, "appendContactsFromFile");
+    if (batch.count > 0) {
+        reserveContacts(book, book->count + batch.count);
+        markSortedIndexesStale(book);
+    }
+    METRIC_TIMER(scanStarted);
+    int duplicates = 0;
+    for (int i = 0; i < batch.count; i++) {
+        if (isDuplicate(book, batch.items[i])) duplicates++;
+        else if (insertContactAt(book, book->count, batch.items[i])) added++;
+    }
+    METRIC_TIME(METRIC_DUPLICATE_SCAN, scanStarted);
+    METRIC_ADD(METRIC_DUPLICATE_CHECKS, batch.count);
+    METRIC_ADD(METRIC_DUPLICATES_FOUND, duplicates);
+    free(batch.items);
+    if (added > 0) printf("%d contacts were successfully appended\n", added);
+    METRIC_TIME(METRIC_APPEND, started);
+    return added;
+}
+
+// Merges an already indexed, sorted batch into a sorted book in one linear pass.
+// Names in the batch are distinct from each other and from the book, so the
+// result matches inserting them one at a time with insertContactAlphabetical.
+int mergeSortedBatch(AddressBook *book, Contact **batch, int batchCount) {
+    int total = book->count + batchCount;
+    Contact **merged = (Contact **)malloc((total > 0 ? total : 1) * sizeof(Contact *));
+    if (!merged) {
+        printf("Error: Memory allocation failed in mergeSortedBatch\n");
+        return 0;
+    }
+    Contact **contacts = dropContactOrder(book);
+    int i = 0, j = 0, k = 0;
+    while (i < book->count && j < batchCount) {
+        if (compareContactNames(batch[j], contacts[i]) < 0) merged[k++] = batch[j++];
+        else merged[k++] = contacts[i++];
+    }
+    while (i < book->count) merged[k++] = contacts[i++];
+    while (j < batchCount) merged[k++] = batch[j++];
+    free(book->contacts);
+    book->contacts = merged;
+    book->count = book->capacity = total;
+    book->order.sorted = 1;
+    if (book->journal) journalMerge(book->journal, batch, batchCount);
+    return 1;
+}
+
+// Merges contacts from file
+int mergeContactsFromFile(AddressBook *book, char *filename) {
+    METRIC_TIMER(started);
+    ContactBatch loaded = {NULL, 0, 0};
+    readContactFile(filename, book, &loaded, 1, "mergeContactsFromFile");
+    Contact **batch = loaded.items;
+    int batchCount = loaded.count;
+    int added = 0;
+    if (batchCount > 0) markSortedIndexesStale(book);
+
+    if (!isSortedByName(book)) {
+        // Insertion points in an unsorted book depend on its order, keep the one-by-one path
+        int duplicates = 0;
+        for (int i = 0; i < batchCount; i++) {
+            if (isDuplicate(book, batch[i])) duplicates++;
+            else if (insertContactAlphabetical(book, batch[i])) added++;
+        }
+        METRIC_ADD(METRIC_DUPLICATE_CHECKS, batchCount);
+        METRIC_ADD(METRIC_DUPLICATES_FOUND, duplicates);
+        free(batch);
+        METRIC_TIME(METRIC_MERGE, started);
+        return added;
+    }
+
+    // Drop duplicates in file order (against the book and earlier records), indexing the survivors
+    METRIC_TIMER(scanStarted);
+    int duplicates = 0;
+    for (int i = 0; i < batchCount; i++) {
+        if (isDuplicate(book, batch[i])) duplicates++;
+        else if (indexContact(book, batch[i])) batch[added++] = batch[i];
+    }
+    METRIC_TIME(METRIC_DUPLICATE_SCAN, scanStarted);
+    METRIC_ADD(METRIC_DUPLICATE_CHECKS, batchCount);
+    METRIC_ADD(METRIC_DUPLICATES_FOUND, duplicates);
+    qsort(batch, added, sizeof(Contact *), compareContactPointers);
+    if (!mergeSortedBatch(book, batch, added)) {
+        for (int i = 0; i < added; i++) unindexContact(book, batch[i]);
+        added = 0;
+    } else if (added > 0) {
+        printf("%d contacts were successfully merged in alphabetical order\n", added);
+    }
+    free(batch);
+    METRIC_TIME(METRIC_MERGE, started);
+    return added;
+}
+
+#define STREAM_READ_SIZE (1 << 20)    // bytes read from an input file at a time
+#define STREAM_MIN_BUFFER (64 << 10)  // smallest read buffer of a run during the merge
+#define STREAM_MIN_MEMORY (16 << 20)  // the read and write buffers alone take a few MB
+#define STREAM_DEFAULT_MEMORY_MB 256
+
+// Bytes held by the arena's blocks
+size_t arenaBytes(const Arena *arena) {
+    size_t bytes = 0;
+    for (ArenaBlock *block = arena->blocks; block; block = block->next) bytes += sizeof(ArenaBlock) + block->size;
+    return bytes;
+}
+
+// Returns freed heap memory to the system. glibc keeps pages of freed arena blocks that lie
+// below later small allocations, which would count against the memory limit of the next run.
+void releaseFreedMemory(void) {
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+// Sorts the batch by name (file order among equal names), keeps the first of each name (or
+// every record with keepAll) and writes it as the next run
+int writeStreamRun(StreamMerge *merge, ContactBatch *batch, int keepAll) {
+    ContactPosition *sorted = (ContactPosition *)malloc(batch->count * sizeof(ContactPosition));
+    char *path = (char *)malloc(PATH_MAX);
+    char **runs = merge->runs;
+    if (merge->runCount == merge->runCapacity) {
+        int capacity = merge->runCapacity > 0 ? merge->runCapacity * 2 : 16;
+        runs = (char **)realloc(merge->runs, capacity * sizeof(char *));
+        if (runs) {
+            merge->runs = runs;
+            merge->runCapacity = capacity;
+        }
+    }
+    if (!sorted || !path || !runs) {
+        printf("Error: Memory allocation failed in mergeFilesStreaming\n");
+        free(sorted);
+        free(path);
+        return 0;
+    }
+    for (int i = 0; i < batch->count; i++) sorted[i] = (ContactPosition){batch->items[i], i};
+    qsort(sorted, batch->count, sizeof(ContactPosition), compareNamesThenPosition);
+    METRIC_ADD(METRIC_STREAM_RUNS, 1);
+    int fd = createTempFile(path, merge->outputFile, "mergeFilesStreaming");
+    OutBuf out;
+    int ok = fd >= 0 && outBufInit(&out, fd, OUTPUT_BUFFER_SIZE);
+    if (ok) {
+        for (int i = 0; i < batch->count; i++) {
+            if (!keepAll && i > 0 && compareContactNames(sorted[i].contact, sorted[i - 1].contact) == 0) continue;
+            outBufPutContact(&out, sorted[i].contact, 0, CONTACT_FORMAT_SAVE);
+        }
+        ok = outBufFlush(&out);
+        outBufFree(&out);
+    }
+    if (fd >= 0 && close(fd) != 0) ok = 0;
+    free(sorted);
+    if (!ok) {
+        if (fd >= 0) {
+            printf("Error: run file %s not written in mergeFilesStreaming\n", path);
+            unlink(path);
+        }
+        free(path);
+        return 0;
+    }
+    merge->runs[merge->runCount++] = path;
+    return 1;
+}
+
+// Offset just past the last complete record (every fifth newline) in data, 0 if there is none
+size_t lastRecordEnd(const char *data, size_t length) {
+    size_t end = 0;
+    int lines = 0;
+    LineScanner scanner;
+    lineScannerInit(&scanner, data, data + length);
+    const char *newline;
+    while ((newline = lineScannerNext(&scanner)) != NULL) {
+        if (++lines == 5) {
+            lines = 0;
+            end = newline + 1 - data;
+        }
+    }
+    return end;
+}
+
+// Reads filename a block at a time and turns it into sorted runs of at most the memory limit.
+// Records are cut at five-line boundaries, so they parse exactly as the whole file would.
+int splitIntoRuns(StreamMerge *merge, char *filename, int keepAll) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: file %s not opened in mergeFilesStreaming\n", filename);
+        return 0;
+    }
+    // Kept free: the read buffer, the run writer and one more block's worth of parsed records
+    size_t budget = merge->memoryLimit - OUTPUT_BUFFER_SIZE - 4 * STREAM_READ_SIZE;
+    size_t capacity = STREAM_READ_SIZE;
+    size_t length = 0;
+    char *data = (char *)malloc(capacity);
+    Arena arena = {NULL};
+    ContactBatch batch = {NULL, 0, 0};
+    ParseReport report = {1, 0, 0, {0}, {0}, {0}};
+    int ok = data != NULL;
+    int eof = 0;
+    if (!ok) printf("Error: Memory allocation failed in mergeFilesStreaming\n");
+    while (ok && !eof) {
+        if (length == capacity) {
+            // A record longer than the buffer
+            char *grown = (char *)realloc(data, capacity * 2);
+            if (!grown) {
+                printf("Error: Memory allocation failed in mergeFilesStreaming\n");
+                ok = 0;
+                break;
+            }
+            data = grown;
+            capacity *= 2;
+        }
+        ssize_t got = read(fd, data + length, capacity - length);
+        if (got < 0) {
+            printf("Error: file %s not read in mergeFilesStreaming\n", filename);
+            ok = 0;
+            break;
+        }
+        eof = got == 0;
+        length += (size_t)got;
+        size_t cut = eof ? length : lastRecordEnd(data, length);
+        if (cut > 0) {
+            ok = parseContactRecords(data, cut, &arena, NULL, &batch, &report);
+            memmove(data, data + cut, length - cut);
+            length -= cut;
+        }
+        // Growing the batch briefly holds two arrays, and qsort may copy the one it sorts
+        size_t used = arenaBytes(&arena) + 2 * batch.capacity * sizeof(Contact *) +
+                      2 * batch.count * sizeof(ContactPosition);
+        if (ok && batch.count > 0 && (eof || used >= budget)) {
+            ok = writeStreamRun(merge, &batch, keepAll);
+            arenaFree(&arena);
+            batch.count = 0;
+            releaseFreedMemory();
+        }
+    }
+    close(fd);
+    printParseReport(&report);
+    free(data);
+    free(batch.items);
+    arenaFree(&arena);
+    releaseFreedMemory();
+    return ok;
+}
+
+// Reads the next record of the run into current; returns 1, 0 at the end of the run or -1 on
+// a read error. The previous record is gone afterwards.
+int runReaderNext(RunReader *reader) {
+    while (1) {
+        size_t ends[5];
+        size_t at = reader->start;
+        int found = 0;
+        for (; found < 5; found++) {
+            char *newline = (char *)memchr(reader->buffer + at, '\n', reader->length - at);
+            if (!newline) break;
+            ends[found] = newline - reader->buffer;
+            at = ends[found] + 1;
+        }
+        if (found == 5) {
+            char *fields[5];
+            for (int i = 0; i < 5; i++) {
+                fields[i] = reader->buffer + (i == 0 ? reader->start : ends[i - 1] + 1);
+                reader->buffer[ends[i]] = '\0';
+            }
+            reader->current.firstName = fields[0];
+            reader->current.familyName = fields[1];
+            reader->current.address = fields[2];
+            reader->current.addressNumber = 0;
+            reader->current.phoneNum = parseNumberField(fields[3], reader->buffer + ends[3]);
+            reader->current.age = (int)parseNumberField(fields[4], reader->buffer + ends[4]);
+            reader->start = at;
+            return 1;
+        }
+        if (reader->eof) return 0; // runs are written by writeStreamRun and end with a whole record
+        memmove(reader->buffer, reader->buffer + reader->start, reader->length - reader->start);
+        reader->length -= reader->start;
+        reader->start = 0;
+        if (reader->length == reader->capacity) {
+            char *grown = (char *)realloc(reader->buffer, reader->capacity * 2);
+            if (!grown) return -1;
+            reader->buffer = grown;
+            reader->capacity *= 2;
+        }
+        ssize_t got = read(reader->fd, reader->buffer + reader->length, reader->capacity - reader->length);
+        if (got < 0) return -1;
+        reader->eof = got == 0;
+        reader->length += (size_t)got;
+    }
+}
+
+// Heap order of the merge: by name, then by rank
+int runReaderBefore(const RunReader *a, const RunReader *b) {
+    int result = compareContactNames(&a->current, &b->current);
+    return result != 0 ? result < 0 : a->rank < b->rank;
+}
+
+void runHeapSiftDown(RunReader **heap, int count, int at) {
+    while (1) {
+        int smallest = at;
+        int left = 2 * at + 1;
+        int right = left + 1;
+        if (left < count && runReaderBefore(heap[left], heap[smallest])) smallest = left;
+        if (right < count && runReaderBefore(heap[right], heap[smallest])) smallest = right;
+        if (smallest == at) return;
+        RunReader *swap = heap[at];
+        heap[at] = heap[smallest];
+        heap[smallest] = swap;
+        at = smallest;
+    }
+}
+
+// Merges count runs into the open file fd with a k-way heap. Records of the first keptRuns
+// runs are all written; any other record only when no record of its name came before it
+// (from a lower-ranked run). Returns the number of records written or -1.
+long long mergeRuns(char **runs, int count, int keptRuns, int fd, size_t memoryLimit) {
+    RunReader *readers = (RunReader *)calloc(count > 0 ? count : 1, sizeof(RunReader));
+    RunReader **heap = (RunReader **)malloc((count > 0 ? count : 1) * sizeof(RunReader *));
+    size_t bufferSize = (memoryLimit - OUTPUT_BUFFER_SIZE - 4 * STREAM_READ_SIZE) / (count > 0 ? count : 1);
+    if (bufferSize < STREAM_MIN_BUFFER) bufferSize = STREAM_MIN_BUFFER;
+    char *last = NULL; // family and first name of the record written last
+    size_t lastCapacity = 0;
+    long long written = 0;
+    int heapCount = 0;
+    int ok = readers && heap;
+    for (int i = 0; ok && i < count; i++) {
+        RunReader *reader = &readers[i];
+        reader->rank = i;
+        reader->fd = open(runs[i], O_RDONLY);
+        reader->buffer = (char *)malloc(bufferSize);
+        reader->capacity = bufferSize;
+        if (reader->fd < 0 || !reader->buffer) {
+            printf("Error: run file %s not opened in mergeFilesStreaming\n", runs[i]);
+            ok = 0;
+            break;
+        }
+        int next = runReaderNext(reader);
+        if (next < 0) ok = 0;
+        else if (next > 0) heap[heapCount++] = reader;
+    }
+    for (int i = heapCount / 2 - 1; i >= 0; i--) runHeapSiftDown(heap, heapCount, i);
+    OutBuf out;
+    int started = ok && outBufInit(&out, fd, OUTPUT_BUFFER_SIZE);
+    ok = started;
+    while (ok && heapCount > 0) {
+        RunReader *reader = heap[0];
+        Contact *contact = &reader->current;
+        size_t familyLength = strlen(contact->familyName);
+        size_t firstLength = strlen(contact->firstName);
+        if (reader->rank < keptRuns || written == 0 || strcmp(last, contact->familyName) != 0 ||
+            strcmp(last + strlen(last) + 1, contact->firstName) != 0) {
+            outBufPutContact(&out, contact, 0, CONTACT_FORMAT_SAVE);
+            if (familyLength + firstLength + 2 > lastCapacity) {
+                size_t capacity = (familyLength + firstLength + 2) * 2;
+                char *grown = (char *)realloc(last, capacity);
+                if (!grown) {
+                    printf("Error: Memory allocation failed in mergeFilesStreaming\n");
+                    ok = 0;
+                    break;
+                }
+                last = grown;
+                lastCapacity = capacity;
+            }
+            memcpy(last, contact->familyName, familyLength + 1);
+            memcpy(last + familyLength + 1, contact->firstName, firstLength + 1);
+            written++;
+        }
+        int next = runReaderNext(reader);
+        if (next < 0) {
+            printf("Error: run file not read in mergeFilesStreaming\n");
+            ok = 0;
+        } else if (next == 0) {
+            heap[0] = heap[--heapCount];
+        }
+        runHeapSiftDown(heap, heapCount, 0);
+    }
+    if (started) {
+        if (!outBufFlush(&out) || out.failed) ok = 0;
+        outBufFree(&out);
+    }
+    for (int i = 0; readers && i < count; i++) {
+        if (readers[i].fd >= 0) close(readers[i].fd);
+        free(readers[i].buffer);
+    }
+    free(readers);
+    free(heap);
+    free(last);
+    return ok ? written : -1;
+}
+
+// Merges the input file into a saved book without holding either in memory: both are cut
+// into sorted runs of at most memoryLimit bytes, then merged into outputFile (which may be
+// bookFile, it is only replaced once the merge is complete) sorted by family and first name. As with mergeContactsFromFile every record of
+// the book is kept, and a record of the input only when its name is neither in the book nor
+// earlier in the input. bookFile may be NULL or empty to only sort the input. Runs are
+// merged at most as many at a time as leave each a STREAM_MIN_BUFFER buffer, in several
+// passes when there are more. Returns the number of contacts written or -1.
+long long mergeFilesStreaming(char *bookFile, char *inputFile, char *outputFile, size_t memoryLimit) {
+    METRIC_TIMER(started);
+    if (memoryLimit < STREAM_MIN_MEMORY) memoryLimit = STREAM_MIN_MEMORY;
+    StreamMerge merge = {outputFile, memoryLimit, NULL, 0, 0, 0};
+    int ok = !bookFile || !bookFile[0] || splitIntoRuns(&merge, bookFile, 1);
+    merge.bookRuns = merge.runCount;
+    ok = ok && splitIntoRuns(&merge, inputFile, 0);
+    int fanIn = (int)((memoryLimit - OUTPUT_BUFFER_SIZE - 4 * STREAM_READ_SIZE) / STREAM_MIN_BUFFER);
+    // Each pass merges neighbouring runs, which keeps the ranks in order. A group never mixes
+    // book and input runs, so a merged run is still wholly one or the other.
+    while (ok && merge.runCount > fanIn) {
+        int merged = 0;
+        int bookRuns = 0;
+        for (int first = 0, count; ok && first < merge.runCount; first += count) {
+            int end = first < merge.bookRuns ? merge.bookRuns : merge.runCount;
+            int fromBook = first < merge.bookRuns;
+            count = end - first < fanIn ? end - first : fanIn;
+            char *path = merge.runs[first];
+            if (count > 1) {
+                path = (char *)malloc(PATH_MAX);
+                int fd = path ? createTempFile(path, outputFile, "mergeFilesStreaming") : -1;
+                if (fd < 0) {
+                    if (!path) printf("Error: Memory allocation failed in mergeFilesStreaming\n");
+                    free(path);
+                    ok = 0;
+                    // The group's runs stay listed so they are removed below
+                    for (int i = first; i < merge.runCount; i++) merge.runs[merged++] = merge.runs[i];
+                    break;
+                }
+                ok = mergeRuns(merge.runs + first, count, fromBook ? count : 0, fd, memoryLimit) >= 0;
+                if (close(fd) != 0) ok = 0;
+                for (int i = first; i < first + count; i++) {
+                    unlink(merge.runs[i]);
+                    free(merge.runs[i]);
+                }
+            }
+            merge.runs[merged++] = path;
+            bookRuns += fromBook;
+            if (!ok) {
+                // Runs of the groups not reached yet stay listed so they are removed below
+                for (int i = first + count; i < merge.runCount; i++) merge.runs[merged++] = merge.runs[i];
+            }
+        }
+        merge.runCount = merged;
+        merge.bookRuns = bookRuns;
+    }
+    // The output is written under a temporary name and renamed over outputFile at the end
+    long long written = -1;
+    char tempPath[PATH_MAX];
+    int fd = ok ? createTempFile(tempPath, outputFile, "mergeFilesStreaming") : -1;
+    if (fd >= 0) {
+        written = mergeRuns(merge.runs, merge.runCount, merge.bookRuns, fd, memoryLimit);
+        if (written >= 0 && fsync(fd) != 0) written = -1;
+        else if (written >= 0) METRIC_ADD(METRIC_FSYNCS, 1);
+        if (close(fd) != 0) written = -1;
+        if (written < 0) printf("Error: writing failed in mergeFilesStreaming\n");
+        if (!replaceWithTempFile(tempPath, outputFile, written >= 0, "mergeFilesStreaming")) written = -1;
+    }
+    for (int i = 0; i < merge.runCount; i++) {
+        unlink(merge.runs[i]);
+        free(merge.runs[i]);
+    }
+    free(merge.runs);
+    if (written >= 0) printf("%lld contacts were written to %s\n", written, outputFile);
+    METRIC_TIME(METRIC_STREAM_MERGE, started);
+    return written;
+}
+
+// 64-bit FNV-1a over 8-byte words (then the tail bytes), used to checksum snapshots
+uint64_t checksumBytes(const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash ^= word;
+        hash *= 1099511628211ULL;
+    }
+    for (; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Saves the contacts as a binary snapshot that loadSnapshotFromFile can map without parsing
+int writeSnapshotFile(Contact **contacts, int count, char *filename, const char *caller) {
+    char tempPath[PATH_MAX];
+    METRIC_TIMER(started);
+    int fd = createTempFile(tempPath, filename, caller);
+    if (fd < 0) return 0;
+    FILE *file = fdopen(fd, "w+b");
+    if (!file) {
+        printf("Error: file not opened in %s\n", caller);
+        close(fd);
+        return replaceWithTempFile(tempPath, filename, 0, caller);
+    }
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.recordSize = sizeof(SnapshotRecord);
+    header.count = (uint64_t)count;
+    fwrite(&header, sizeof(header), 1, file); // rewritten once the checksums are known
+
+    // Records, laying out the heap offsets as we go
+    uint64_t offset = 0;
+    for (int i = 0; i < count; i++) {
+        Contact *contact = contacts[i];
+        SnapshotRecord record;
+        memset(&record, 0, sizeof(record));
+        record.nameHash = hashFullName(contact->firstName, contact->familyName);
+        record.firstNameOffset = offset;
+        offset += strlen(contact->firstName) + 1;
+        record.familyNameOffset = offset;
+        offset += strlen(contact->familyName) + 1;
+        record.addressOffset = offset;
+        offset += contactAddressLength(contact) + 1;
+        record.phoneNum = contact->phoneNum;
+        record.age = contact->age;
+        fwrite(&record, sizeof(record), 1, file);
+    }
+    header.heapSize = offset;
+
+    // Heap, in the same order as the offsets above
+    for (int i = 0; i < count; i++) {
+        Contact *contact = contacts[i];
+        fwrite(contact->firstName, 1, strlen(contact->firstName) + 1, file);
+        fwrite(contact->familyName, 1, strlen(contact->familyName) + 1, file);
+        char number[ADDRESS_NUMBER_SIZE];
+        fwrite(number, 1, formatAddressNumber(number, contact), file);
+        fwrite(contact->address, 1, strlen(contact->address) + 1, file);
+    }
+    // A failed fwrite (a full disk) only sets the error flag and drops its data, so the flag is
+    // checked and the size confirmed before the file is mapped: a short mapping would raise SIGBUS
+    size_t recordsSize = (size_t)header.count * sizeof(SnapshotRecord);
+    size_t fileSize = sizeof(header) + recordsSize + (size_t)header.heapSize;
+    struct stat info;
+    if (fflush(file) != 0 || ferror(file) || fstat(fileno(file), &info) != 0 || (size_t)info.st_size != fileSize) {
+        printf("Error: writing failed in %s\n", caller);
+        fclose(file);
+        return replaceWithTempFile(tempPath, filename, 0, caller);
+    }
+
+    // Checksum the sections straight from the file (still in the page cache), then fill in the header
+    char *data = (char *)mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fileno(file), 0);
+    if (data == MAP_FAILED) {
+        printf("Error: file could not be mapped in %s\n", caller);
+        fclose(file);
+        return replaceWithTempFile(tempPath, filename, 0, caller);
+    }
+    header.recordsChecksum = checksumBytes(data + sizeof(header), recordsSize);
+    header.heapChecksum = checksumBytes(data + sizeof(header) + recordsSize, (size_t)header.heapSize);
+    munmap(data, fileSize);
+    header.headerChecksum = checksumBytes(&header, offsetof(SnapshotHeader, headerChecksum));
+    int ok = fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0) ok = 0;
+    if (!ok) printf("Error: writing failed in %s\n", caller);
+    else METRIC_ADD(METRIC_FSYNCS, 1);
+    if (!replaceWithTempFile(tempPath, filename, ok, caller)) return 0;
+    METRIC_TIME(METRIC_SNAPSHOT_SAVE, started);
+    return 1;
+}
+
+// Saves the book as a binary snapshot
+int saveSnapshotToFile(AddressBook *book, char *filename) {
+    if (!filename) {
+        printf("Error: filename formal parameter passed value NULL in saveSnapshotToFile\n");
+        return 0;
+    }
+    if (!book) {
+        printf("Error: addressBook formal parameter passed value NULL in saveSnapshotToFile\n");
+        return 0;
+    }
+    return writeSnapshotFile(bookContacts(book), book->count, filename, "saveSnapshotToFile");
+}
+
+// Whether snapshot loads verify the checksums of the records and strings; ADDRESSBOOK_SNAPSHOT_CHECKSUMS=0
+// skips reading the whole file up front, leaving the header checksum and bounds checks
+int snapshotChecksumsEnabled(void) {
+    const char *setting = getenv("ADDRESSBOOK_SNAPSHOT_CHECKSUMS");
+    return !setting || strcmp(setting, "0") != 0;
+}
+
+// Loads a binary snapshot, replacing the existing contacts. Records are turned into contacts
+// without any parsing and their strings stay in the mapping until a contact is edited; the
+// indexes are built on first use.
+int loadSnapshotFromFile(AddressBook *book, char *filename) {
+    METRIC_TIMER(started);
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: file not opened in loadSnapshotFromFile\n");
+        return 0;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SnapshotHeader)) {
+        printf("Error: %s is not an address book snapshot\n", filename);
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t)info.st_size;
+    char *data = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("Error: file could not be mapped in loadSnapshotFromFile\n");
+        return 0;
+    }
+
+    // Validate everything before the current book is thrown away
+    SnapshotHeader header;
+    memcpy(&header, data, sizeof(header));
+    const char *problem = NULL;
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+        problem = "is not an address book snapshot";
+    } else if (header.version != SNAPSHOT_VERSION || header.recordSize != sizeof(SnapshotRecord)) {
+        problem = "has an unsupported snapshot version";
+    } else if (header.headerChecksum != checksumBytes(&header, offsetof(SnapshotHeader, headerChecksum)) ||
+               header.count > INT_MAX ||
+               header.heapSize > size - sizeof(header) ||
+               header.count > (size - sizeof(header) - header.heapSize) / sizeof(SnapshotRecord) ||
+               sizeof(header) + header.count * sizeof(SnapshotRecord) + header.heapSize != size) {
+        problem = "has a damaged header";
+    }
+    const SnapshotRecord *records = (const SnapshotRecord *)(data + sizeof(header));
+    const char *heap = data + sizeof(header) + header.count * sizeof(SnapshotRecord);
+    if (!problem && snapshotChecksumsEnabled() &&
+        (checksumBytes(records, header.count * sizeof(SnapshotRecord)) != header.recordsChecksum ||
+         checksumBytes(heap, header.heapSize) != header.heapChecksum)) {
+        problem = "failed its checksum";
+    }
+    if (!problem && header.heapSize > 0 && heap[header.heapSize - 1] != 0) problem = "has a damaged string heap";
+    for (uint64_t i = 0; !problem && i < header.count; i++) {
+        if (records[i].firstNameOffset >= header.heapSize || records[i].familyNameOffset >= header.heapSize ||
+            records[i].addressOffset >= header.heapSize) {
+            problem = "has a record pointing outside its string heap";
+        }
+    }
+    if (problem) {
+        printf("Error: %s %s\n", filename, problem);
+        munmap(data, size);
+        return 0;
+    }
+
+    Journal *journal = book->journal;
+    freeAddressBook(book);
+    initAddressBook(book);
+    book->journal = journal;
+    int count = (int)header.count;
+    MappedFile *mapping = (MappedFile *)malloc(sizeof(MappedFile));
+    Contact *contacts = count > 0 ? (Contact *)arenaAlloc(&book->storage, count * sizeof(Contact)) : NULL;
+    if (!mapping || (count > 0 && !contacts) || !reserveContacts(book, count)) {
+        printf("Error: Memory allocation failed in loadSnapshotFromFile\n");
+        free(mapping);
+        munmap(data, size);
+        return 0;
+    }
+    mapping->data = data;
+    mapping->size = size;
+    mapping->next = book->mappings;
+    book->mappings = mapping;
+    for (int i = 0; i < count; i++) {
+        contacts[i].firstName = (char *)heap + records[i].firstNameOffset;
+        contacts[i].familyName = (char *)heap + records[i].familyNameOffset;
+        contacts[i].address = (char *)heap + records[i].addressOffset;
+        contacts[i].addressNumber = 0;
+        contacts[i].phoneNum = records[i].phoneNum;
+        contacts[i].age = records[i].age;
+        book->contacts[i] = &contacts[i];
+    }
+    book->count = count;
+    // Every index is built on first use, so the load itself does no hashing or sorting
+    book->hashesStale = count > 0;
+    markSortedIndexesStale(book);
+    markScanIndexesStale(book);
+    if (journal) compactJournal(book);
+    METRIC_TIME(METRIC_SNAPSHOT_LOAD, started);
+    return count;
+}
+
+// Appends raw bytes to the journal's pending buffer
+int journalPut(Journal *journal, const void *data, size_t size) {
+    if (journal->length + size > journal->capacity) {
+        size_t capacity = journal->capacity ? journal->capacity : JOURNAL_BUFFER_SIZE;
+        while (capacity < journal->length + size) capacity *= 2;
+        char *buffer = (char *)realloc(journal->buffer, capacity);
+        if (!buffer) {
+            printf("Error: Memory reallocation failed in journalPut\n");
+            return 0;
+        }
+        journal->buffer = buffer;
+        journal->capacity = capacity;
+    }
+    memcpy(journal->buffer + journal->length, data, size);
+    journal->length += size;
+    return 1;
+}
+
+// Length-prefixed string
+int journalPutString(Journal *journal, const char *text) {
+    uint32_t length = (uint32_t)strlen(text);
+    return journalPut(journal, &length, sizeof(length)) && journalPut(journal, text, length);
+}
+
+// The full address as a length-prefixed string
+int journalPutAddress(Journal *journal, const Contact *contact) {
+    char number[ADDRESS_NUMBER_SIZE];
+    uint32_t numberLength = (uint32_t)formatAddressNumber(number, contact);
+    uint32_t length = numberLength + (uint32_t)strlen(contact->address);
+    return journalPut(journal, &length, sizeof(length)) && journalPut(journal, number, numberLength) &&
+           journalPut(journal, contact->address, length - numberLength);
+}
+
+// Contact fields in journal order: first name, family name, address, phone, age
+int journalPutContact(Journal *journal, const Contact *contact) {
+    int64_t phoneNum = contact->phoneNum;
+    int32_t age = contact->age;
+    return journalPutString(journal, contact->firstName) && journalPutString(journal, contact->familyName) &&
+           journalPutAddress(journal, contact) && journalPut(journal, &phoneNum, sizeof(phoneNum)) &&
+           journalPut(journal, &age, sizeof(age));
+}
+
+// Starts a record: reserves its frame (payload length and checksum) and writes the op code.
+// start is set even on failure so journalEndRecord can drop what was written.
+int journalBeginRecord(Journal *journal, char op, size_t *start) {
+    *start = journal->length;
+    uint32_t frame[2] = {0, 0};
+    return journalPut(journal, frame, sizeof(frame)) && journalPut(journal, &op, 1);
+}
+
+// Fills in the frame of the record started at start; with JOURNAL_FSYNC_ALWAYS it is made durable right away.
+// If the record could not be built (ok is 0) its partial bytes are dropped and the change is reported as not journaled.
+int journalEndRecord(Journal *journal, size_t start, int ok, const char *caller) {
+    if (!ok) {
+        journal->length = start;
+        printf("Error: the change was not journaled in %s, compact the journal to save it\n", caller);
+        return 0;
+    }
+    uint32_t frame[2];
+    frame[0] = (uint32_t)(journal->length - start - sizeof(frame));
+    frame[1] = (uint32_t)checksumBytes(journal->buffer + start + sizeof(frame), frame[0]);
+    memcpy(journal->buffer + start, frame, sizeof(frame));
+    journal->records++;
+    METRIC_ADD(METRIC_JOURNAL_RECORDS, 1);
+    if (journal->fsyncPolicy == JOURNAL_FSYNC_ALWAYS || journal->length >= JOURNAL_BUFFER_SIZE) journalCommit(journal);
+    return 1;
+}
+
+// Writes the pending records with one write() and syncs them unless the policy says not to
+int journalCommit(Journal *journal) {
+    if (!journal || journal->length == 0) return 1;
+    METRIC_TIMER(started);
+    if (!writeAll(journal->fd, journal->buffer, journal->length)) {
+        printf("Error: write failed in journalCommit\n");
+        return 0;
+    }
+    journal->length = 0;
+    if (journal->fsyncPolicy != JOURNAL_FSYNC_NEVER) {
+        METRIC_ADD(METRIC_FSYNCS, 1);
+        if (fsync(journal->fd) != 0) {
+            printf("Error: fsync failed in journalCommit\n");
+            return 0;
+        }
+    }
+    METRIC_TIME(METRIC_JOURNAL_COMMIT, started);
+    return 1;
+}
+
+int journalInsert(Journal *journal, int position, Contact *contact) {
+    int32_t at = position;
+    size_t start;
+    int ok = journalBeginRecord(journal, 'P', &start) && journalPut(journal, &at, sizeof(at)) &&
+             journalPutContact(journal, contact);
+    return journalEndRecord(journal, start, ok, "journalInsert");
+}
+
+int journalDelete(Journal *journal, int position) {
+    int32_t at = position;
+    size_t start;
+    int ok = journalBeginRecord(journal, 'D', &start) && journalPut(journal, &at, sizeof(at));
+    return journalEndRecord(journal, start, ok, "journalDelete");
+}
+
+// Records the full state of the contact at index after an edit
+int journalEdit(Journal *journal, int index, Contact *contact) {
+    int32_t at = index;
+    size_t start;
+    int ok = journalBeginRecord(journal, 'E', &start) && journalPut(journal, &at, sizeof(at)) &&
+             journalPutContact(journal, contact);
+    return journalEndRecord(journal, start, ok, "journalEdit");
+}
+
+// Records a batch handed to mergeSortedBatch, in its sorted order
+int journalMerge(Journal *journal, Contact **batch, int batchCount) {
+    int32_t count = batchCount;
+    size_t start;
+    int ok = journalBeginRecord(journal, 'M', &start) && journalPut(journal, &count, sizeof(count));
+    for (int i = 0; ok && i < batchCount; i++) ok = journalPutContact(journal, batch[i]);
+    return journalEndRecord(journal, start, ok, "journalMerge");
+}
+
+// Reads a journal field, failing when the record is too short
+int journalGet(const char **cursor, const char *end, void *out, size_t size) {
+    if ((size_t)(end - *cursor) < size) return 0;
+    memcpy(out, *cursor, size);
+    *cursor += size;
+    return 1;
+}
+
+// Decodes a contact written by journalPutContact into arena memory, sharing strings through
+// the pool when there is one
+int journalGetContact(const char **cursor, const char *end, Arena *arena, StringPool *strings, Contact *contact) {
+    const char *texts[3];
+    uint32_t lengths[3];
+    for (int i = 0; i < 3; i++) {
+        if (!journalGet(cursor, end, &lengths[i], sizeof(lengths[i])) || (size_t)(end - *cursor) < lengths[i]) return 0;
+        texts[i] = *cursor;
+        *cursor += lengths[i];
+    }
+    contact->firstName = storeString(arena, strings, texts[0], lengths[0]);
+    contact->familyName = storeString(arena, strings, texts[1], lengths[1]);
+    if (!contact->firstName || !contact->familyName || !storeAddress(arena, strings, contact, texts[2], lengths[2])) {
+        return 0;
+    }
+    int64_t phoneNum;
+    int32_t age;
+    if (!journalGet(cursor, end, &phoneNum, sizeof(phoneNum)) || !journalGet(cursor, end, &age, sizeof(age))) return 0;
+    contact->phoneNum = phoneNum;
+    contact->age = age;
+    return 1;
+}
+
+// Applies one journal record to the book (journaling must be off while replaying)
+int journalApply(AddressBook *book, const char *payload, size_t size) {
+    const char *cursor = payload + 1;
+    const char *end = payload + size;
+    int32_t at;
+    if (size < 1) return 0;
+    switch (payload[0]) {
+        case 'P': {
+            Contact *contact = (Contact *)arenaAlloc(&book->storage, sizeof(Contact));
+            if (!contact || !journalGet(&cursor, end, &at, sizeof(at)) || at < 0 || at > book->count ||
+                !journalGetContact(&cursor, end, &book->storage, bookStrings(book), contact)) return 0;
+            return insertContactAt(book, at, contact);
+        }
+        case 'D':
+            if (!journalGet(&cursor, end, &at, sizeof(at)) || at < 0 || at >= book->count) return 0;
+            deleteContactAt(book, at);
+            return 1;
+        case 'E': {
+            Contact edited;
+            if (!journalGet(&cursor, end, &at, sizeof(at)) || at < 0 || at >= book->count ||
+                !journalGetContact(&cursor, end, &book->storage, bookStrings(book), &edited)) return 0;
+            // Replaced by a copy like setContactField does
+            Contact *contact = (Contact *)arenaAlloc(&book->storage, sizeof(Contact));
+            if (!contact) return 0;
+            *contact = edited;
+            unindexContact(book, bookContactAt(book, at));
+            bookSetContactAt(book, at, contact);
+            return indexContact(book, contact);
+        }
+        case 'M': {
+            int32_t count;
+            if (!journalGet(&cursor, end, &count, sizeof(count)) || count < 0) return 0;
+            Contact **batch = (Contact **)malloc((count > 0 ? count : 1) * sizeof(Contact *));
+            Contact *contacts = count > 0 ? (Contact *)arenaAlloc(&book->storage, count * sizeof(Contact)) : NULL;
+            if (!batch || (count > 0 && !contacts)) {
+                free(batch);
+                return 0;
+            }
+            int ok = 1;
+            for (int i = 0; ok && i < count; i++) {
+                ok = journalGetContact(&cursor, end, &book->storage, bookStrings(book), &contacts[i]);
+                batch[i] = &contacts[i];
+            }
+            if (ok) ok = indexContactsMany(book, batch, count, NULL) && mergeSortedBatch(book, batch, count);
+            free(batch);
+            return ok;
+        }
+    }
+    return 0;
+}
+
+// Replays every intact record of the journal file. A torn or corrupt tail (for example
+// from a crash mid-write) is cut off so new records are appended after the last good one.
+long long replayJournal(AddressBook *book, const char *path) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return 0;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t)info.st_size;
+    char *data = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        printf("Error: journal could not be mapped in replayJournal\n");
+        close(fd);
+        return -1;
+    }
+    Journal *journal = book->journal;
+    book->journal = NULL;
+    markSortedIndexesStale(book);
+    size_t offset = 0;
+    long long applied = 0;
+    while (size - offset >= 2 * sizeof(uint32_t)) {
+        uint32_t frame[2];
+        memcpy(frame, data + offset, sizeof(frame));
+        const char *payload = data + offset + sizeof(frame);
+        if (frame[0] > size - offset - sizeof(frame) ||
+            frame[1] != (uint32_t)checksumBytes(payload, frame[0]) ||
+            !journalApply(book, payload, frame[0])) break;
+        offset += sizeof(frame) + frame[0];
+        applied++;
+    }
+    book->journal = journal;
+    munmap(data, size);
+    if (offset < size) {
+        printf("Error: journal %s is damaged after record %lld, the rest was discarded\n", path, applied);
+        if (ftruncate(fd, (off_t)offset) != 0) printf("Error: journal could not be truncated in replayJournal\n");
+    }
+    close(fd);
+    return applied;
+}
+
+// Opens basePath in journal mode: loads the base text file (if any), replays basePath.journal
+// over it and keeps logging every mutation there until the journal is closed
+Journal *openJournal(AddressBook *book, char *basePath, int fsyncPolicy) {
+    Journal *journal = (Journal *)calloc(1, sizeof(Journal));
+    if (!journal) {
+        printf("Error: Memory allocation failed in openJournal\n");
+        return NULL;
+    }
+    journal->fd = -1;
+    journal->basePath = strdup(basePath);
+    journal->journalPath = (char *)malloc(strlen(basePath) + sizeof(".journal"));
+    if (!journal->basePath || !journal->journalPath) {
+        printf("Error: Memory allocation failed in openJournal\n");
+        closeJournal(journal);
+        return NULL;
+    }
+    sprintf(journal->journalPath, "%s.journal", basePath);
+    journal->fsyncPolicy = fsyncPolicy;
+
+    closeJournal(book->journal);
+    book->journal = NULL;
+    struct stat info;
+    freeAddressBook(book);
+    initAddressBook(book);
+    if (stat(basePath, &info) == 0) loadContactsFromFile(book, basePath);
+    long long replayed = replayJournal(book, journal->journalPath);
+    journal->fd = open(journal->journalPath, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (replayed < 0 || journal->fd < 0) {
+        printf("Error: journal not opened in openJournal\n");
+        closeJournal(journal);
+        return NULL;
+    }
+    journal->records = replayed;
+    book->journal = journal;
+    printf("Opened %s with %d contacts (%lld journal records replayed)\n", basePath, book->count, replayed);
+    return journal;
+}
+
+// Commits pending records and releases the journal
+void closeJournal(Journal *journal) {
+    if (!journal) return;
+    if (journal->fd >= 0) {
+        journalCommit(journal);
+        close(journal->fd);
+    }
+    free(journal->buffer);
+    free(journal->basePath);
+    free(journal->journalPath);
+    free(journal);
+}
+
+// Folds the journal into the base file: writes the book to a temporary file, syncs it,
+// renames it over the base and only then empties the journal
+int compactJournal(AddressBook *book) {
+    Journal *journal = book->journal;
+    if (!journal) {
+        printf("Error: no journal is open in compactJournal\n");
+        return 0;
+    }
+    if (!journalCommit(journal)) return 0;
+    // Saving replaces the base file only once the new one is on disk
+    if (!saveContactsToFile(book, journal->basePath)) {
+        printf("Error: base file could not be replaced in compactJournal\n");
+        return 0;
+    }
+    if (ftruncate(journal->fd, 0) != 0 || fsync(journal->fd) != 0) {
+        printf("Error: journal could not be truncated in compactJournal\n");
+        return 0;
+    }
+    METRIC_ADD(METRIC_FSYNCS, 1);
+    journal->records = 0;
+    return 1;
+}
+
+// Sets one field of the contact at index and keeps the indexes in sync; text is a string
+// from storeEditText for the name and address fields, number the phone, the age or the house
+// number storeEditText split off the address. The contact is copied
+// first since published views may be reading it (the arena never frees single contacts),
+// the copy is returned.
+Contact *setContactField(AddressBook *book, int index, int field, char *text, long long number) {
+    Contact *old = bookContactAt(book, index);
+    if (field < CONTACT_FIELD_FIRST_NAME || field > CONTACT_FIELD_AGE) return old;
+    METRIC_TIMER(started);
+    Contact *contact = (Contact *)arenaAlloc(&book->storage, sizeof(Contact));
+    if (!contact) return old;
+    *contact = *old;
+    if (field == CONTACT_FIELD_FIRST_NAME) contact->firstName = text;
+    else if (field == CONTACT_FIELD_FAMILY_NAME) contact->familyName = text;
+    else if (field == CONTACT_FIELD_ADDRESS) {
+        contact->address = text;
+        contact->addressNumber = (unsigned int)number;
+    }
+    else if (field == CONTACT_FIELD_PHONE) contact->phoneNum = number;
+    else contact->age = (int)number;
+    if (field == CONTACT_FIELD_ADDRESS || field == CONTACT_FIELD_AGE) {
+        reindexCopy(book, old, contact);
+    } else {
+        unindexContact(book, old);
+        indexContact(book, contact);
+    }
+    bookSetContactAt(book, index, contact);
+    if (book->journal) journalEdit(book->journal, index, contact);
+    METRIC_TIME(METRIC_EDIT, started);
+    return contact;
+}
+
+// Stores the new text of a name or address field for setContactField the way new contacts
+// store theirs; for the address *number gets the house number storeAddress splits off
+char *storeEditText(AddressBook *book, int field, const char *text, size_t length, long long *number) {
+    *number = 0;
+    if (field != CONTACT_FIELD_ADDRESS) return storeString(&book->storage, bookStrings(book), text, length);
+    Contact stored;
+    if (!storeAddress(&book->storage, bookStrings(book), &stored, text, length)) return NULL;
+    *number = stored.addressNumber;
+    return stored.address;
+}
+
+// Edits contact by index
+Contact *editContact(AddressBook *book, int index) {
+    int count = countContacts(book);
+    if (index < 0 || index >= count) return NULL;
+    Contact *contact = bookContactAt(book, index);
+    int choice;
+    char buffer[256];
+    char *copy;
+    long long number;
+    while (1) {
+        printf("1. Edit First Name\n2. Edit Last Name\n3. Edit Address\n4. Edit Phone Number\n5. Edit Age\n6. Cancel\n");
+        printf("Select an option: ");
+        scanf("%d", &choice); 
+        while (getchar() != '\n');
+        switch (choice) {
+            case CONTACT_FIELD_FIRST_NAME:
+            case CONTACT_FIELD_FAMILY_NAME:
+            case CONTACT_FIELD_ADDRESS:
+                if (choice == CONTACT_FIELD_FIRST_NAME) printf("Enter new first name: ");
+                else if (choice == CONTACT_FIELD_FAMILY_NAME) printf("Enter new family name: ");
+                else printf("Enter new address: ");
+                fgets(buffer, sizeof(buffer), stdin);
+                buffer[strcspn(buffer, "\n")] = 0;
+                copy = storeEditText(book, choice, buffer, strlen(buffer), &number);
+                if (!copy) break;
+                contact = setContactField(book, index, choice, copy, number);
+                break;
+            case CONTACT_FIELD_PHONE:
+                printf("Enter new 10-digit phone number: ");
+                fgets(buffer, sizeof(buffer), stdin);
+                if (!parsePhoneDigits(buffer, strcspn(buffer, "\n"), &number)) {
+                    printf("Error: Invalid phone number, it was left unchanged\n");
+                    break;
+                }
+                contact = setContactField(book, index, choice, NULL, number);
+                break;
+            case CONTACT_FIELD_AGE:
+                printf("Enter new age: ");
+                fgets(buffer, sizeof(buffer), stdin);
+                if (!parseAgeDigits(buffer, strcspn(buffer, "\n"), &number)) {
+                    printf("Error: Invalid age, it was left unchanged\n");
+                    break;
+                }
+                contact = setContactField(book, index, choice, NULL, number);
+                break;
+            case 6:
+                return contact;
+            default:
+                printf("Invalid option.\n");
+        }
+    }
+    return contact;
+}
+
+int initSharedBook(SharedBook *shared) {
+    if (!initAddressBook(&shared->book)) return 0;
+    pthread_mutex_init(&shared->writeLock, NULL);
+    pthread_mutex_init(&shared->viewLock, NULL);
+    shared->view = NULL;
+    shared->generation = 0;
+    return publishBookView(shared);
+}
+
+// Frees the book once every reader released its view (and no writer holds the lock)
+void freeSharedBook(SharedBook *shared) {
+    if (shared->view) releaseBookView(shared->view);
+    shared->view = NULL;
+    freeAddressBook(&shared->book);
+    pthread_mutex_destroy(&shared->writeLock);
+    pthread_mutex_destroy(&shared->viewLock);
+}
+
+// Copies the contacts vector into a new view and makes it the current one. Called by the
+// writer holding writeLock; readers holding the previous view keep it until they release it.
+int publishBookView(SharedBook *shared) {
+    AddressBook *book = &shared->book;
+    BookView *view = (BookView *)malloc(sizeof(BookView));
+    Contact **contacts = (Contact **)malloc((book->count > 0 ? book->count : 1) * sizeof(Contact *));
+    if (!book->pin) {
+        book->pin = (StoragePin *)calloc(1, sizeof(StoragePin));
+        if (book->pin) atomic_init(&book->pin->refs, 1);
+    }
+    if (!view || !contacts || !book->pin) {
+        printf("Error: Memory allocation failed in publishBookView\n");
+        free(view);
+        free(contacts);
+        return 0;
+    }
+    if (book->count > 0) memcpy(contacts, bookContacts(book), book->count * sizeof(Contact *));
+    view->contacts = contacts;
+    view->count = book->count;
+    view->generation = ++shared->generation;
+    atomic_init(&view->refs, 1);
+    view->pin = book->pin;
+    atomic_fetch_add(&book->pin->refs, 1);
+
+    pthread_mutex_lock(&shared->viewLock);
+    BookView *old = shared->view;
+    shared->view = view;
+    pthread_mutex_unlock(&shared->viewLock);
+    METRIC_ADD(METRIC_VIEWS_PUBLISHED, 1);
+    if (old) releaseBookView(old);
+    return 1;
+}
+
+// The current view, valid until releaseBookView; never waits for a writer
+BookView *acquireBookView(SharedBook *shared) {
+    pthread_mutex_lock(&shared->viewLock);
+    BookView *view = shared->view;
+    atomic_fetch_add(&view->refs, 1);
+    pthread_mutex_unlock(&shared->viewLock);
+    return view;
+}
+
+void releaseBookView(BookView *view) {
+    if (atomic_fetch_sub(&view->refs, 1) != 1) return;
+    free(view->contacts);
+    releaseStoragePin(view->pin);
+    free(view);
+}
+
+// Takes the writer side of the book; without wait, NULL when another writer holds it
+AddressBook *lockSharedBook(SharedBook *shared, int wait) {
+    if (pthread_mutex_trylock(&shared->writeLock) != 0) {
+        if (!wait) return NULL;
+        pthread_mutex_lock(&shared->writeLock);
+    }
+    return &shared->book;
+}
+
+// Publishes the changes (if any) and lets the next writer in
+void unlockSharedBook(SharedBook *shared, int changed) {
+    if (changed) publishBookView(shared);
+    pthread_mutex_unlock(&shared->writeLock);
+}
+
+void listBookView(BookView *view) {
+    if (view->count == 0) {
+        printf("No contacts available.\n");
+        return;
+    }
+    METRIC_TIMER(started);
+    printContactList(view->contacts, view->count);
+    METRIC_TIME(METRIC_LIST, started);
+}
+
+int saveBookView(BookView *view, char *filename) {
+    METRIC_TIMER(started);
+    int ok = writeContactFile(view->contacts, view->count, filename, "saveBookView");
+    METRIC_TIME(METRIC_SAVE, started);
+    return ok;
+}
+
+void printBookView(BookView *view, char *filename) {
+    METRIC_TIMER(started);
+    writeContactReport(view->contacts, view->count, filename, "printBookView");
+    METRIC_TIME(METRIC_PRINT, started);
+}
+
+int saveBookViewSnapshot(BookView *view, char *filename) {
+    return writeSnapshotFile(view->contacts, view->count, filename, "saveBookViewSnapshot");
+}
+
+// Searches of a view scan it, the indexes belong to the writer
+int findViewContactsByPhone(BookView *view, long long phoneNum, ContactBatch *results) {
+    METRIC_TIMER(started);
+    int found = 0;
+    for (int i = 0; i < view->count; i++) {
+        if (view->contacts[i]->phoneNum == phoneNum) {
+            if (!addToBatch(results, view->contacts[i])) break;
+            found++;
+        }
+    }
+    METRIC_TIME(METRIC_FIND_PHONE, started);
+    return found;
+}
+
+// Same results and order as findContactsByPrefix
+int findViewContactsByPrefix(BookView *view, const char *prefix, int byFirstName, ContactBatch *results) {
+    METRIC_TIMER(started);
+    size_t length = strlen(prefix);
+    int first = results->count;
+    for (int i = 0; i < view->count; i++) {
+        const char *key = byFirstName ? view->contacts[i]->firstName : view->contacts[i]->familyName;
+        if (strncmp(key, prefix, length) == 0 && !addToBatch(results, view->contacts[i])) break;
+    }
+    qsort(results->items + first, results->count - first, sizeof(Contact *),
+          byFirstName ? compareFirstNamePointers : compareContactPointers);
+    METRIC_TIME(METRIC_FIND_PREFIX, started);
+    return results->count - first;
+}
+
+// Same results and order as findContactsByFilter
+int findViewContactsByFilter(BookView *view, const ContactFilter *filter, ContactBatch *results,
+                             ContactAggregate *aggregate) {
+    METRIC_TIMER(started);
+    int ok = filterContacts(view->contacts, view->count, filter, results, aggregate);
+    METRIC_TIME(METRIC_FILTER, started);
+    return ok;
+}
+
+// Same results and ranking as findContactsFuzzy, checking every contact of the view
+int findViewContactsFuzzy(BookView *view, int key, const char *text, int maxDistance, int limit, FuzzyMatch *matches) {
+    if (key < 0 || key >= FUZZY_KEY_COUNT) return 0;
+    if (maxDistance > FUZZY_MAX_DISTANCE) maxDistance = FUZZY_MAX_DISTANCE;
+    METRIC_TIMER(started);
+    FuzzyQuery query;
+    if (!fuzzyQueryInit(&query, key, text, maxDistance)) return 0;
+    int count = fuzzyScan(&query, view->contacts, view->count) ? fuzzyRank(&query, limit, matches) : 0;
+    fuzzyQueryFree(&query);
+    METRIC_TIME(METRIC_FUZZY_SEARCH, started);
+    return count;
+}
+
+void *runBackgroundImport(void *arg) {
+    BackgroundImport *job = (BackgroundImport *)arg;
+    AddressBook *book = lockSharedBook(job->shared, 1);
+    int added = job->merge ? mergeContactsFromFile(book, job->filename) : appendContactsFromFile(book, job->filename);
+    if (book->journal) journalCommit(book->journal);
+    unlockSharedBook(job->shared, added > 0);
+    printf("Background import of %s finished\n", job->filename);
+    return NULL;
+}
+
+// Appends (or merges) the file on a new thread; an earlier import is waited for first
+int startBackgroundImport(BackgroundImport *job, SharedBook *shared, const char *filename, int merge) {
+    finishBackgroundImport(job);
+    job->shared = shared;
+    job->merge = merge;
+    snprintf(job->filename, sizeof(job->filename), "%s", filename);
+    if (pthread_create(&job->thread, NULL, runBackgroundImport, job) != 0) {
+        printf("Error: thread not started in startBackgroundImport\n");
+        return 0;
+    }
+    job->running = 1;
+    return 1;
+}
+
+void finishBackgroundImport(BackgroundImport *job) {
+    if (!job->running) return;
+    pthread_join(job->thread, NULL);
+    job->running = 0;
+}
+
+void initBackgroundSaver(BackgroundSaver *saver, SharedBook *shared) {
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC); // autosave deadlines are monotonic
+    pthread_cond_init(&saver->changed, &attributes);
+    pthread_condattr_destroy(&attributes);
+    pthread_mutex_init(&saver->lock, NULL);
+    saver->shared = shared;
+    saver->first = saver->last = NULL;
+    saver->writing = saver->stopping = 0;
+    saver->autosaveSeconds = 0;
+    saver->autosaveFile[0] = 0;
+    saver->autosaved = 0;
+    saver->running = 0;
+}
+
+// Writes the file of a job and drops its view
+void writeSaveJob(SaveJob *job) {
+    if (job->kind == SAVE_REPORT) printBookView(job->view, job->filename);
+    else if (job->kind == SAVE_SNAPSHOT) saveBookViewSnapshot(job->view, job->filename);
+    else saveBookView(job->view, job->filename);
+    releaseBookView(job->view);
+    free(job);
+}
+
+// Adds a job to the end of the queue; saver->lock held
+void pushSaveJob(BackgroundSaver *saver, SaveJob *job) {
+    job->next = NULL;
+    if (saver->last) saver->last->next = job;
+    else saver->first = job;
+    saver->last = job;
+    pthread_cond_broadcast(&saver->changed);
+}
+
+// Queues an autosave of the current view once the interval is over, unless the book did not
+// change since the last one; saver->lock held
+void autosaveIfDue(BackgroundSaver *saver) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec < saver->nextAutosave.tv_sec ||
+        (now.tv_sec == saver->nextAutosave.tv_sec && now.tv_nsec < saver->nextAutosave.tv_nsec)) return;
+    saver->nextAutosave = now;
+    saver->nextAutosave.tv_sec += saver->autosaveSeconds;
+    BookView *view = acquireBookView(saver->shared);
+    if (view->generation == saver->autosaved) {
+        releaseBookView(view);
+        return;
+    }
+    SaveJob *job = (SaveJob *)malloc(sizeof(SaveJob));
+    if (!job) {
+        printf("Error: Memory allocation failed in autosaveIfDue\n");
+        releaseBookView(view);
+        return;
+    }
+    saver->autosaved = view->generation;
+    job->view = view;
+    job->kind = SAVE_CONTACTS;
+    snprintf(job->filename, sizeof(job->filename), "%s", saver->autosaveFile);
+    pushSaveJob(saver, job);
+}
+
+void *runBackgroundSaver(void *arg) {
+    BackgroundSaver *saver = (BackgroundSaver *)arg;
+    pthread_mutex_lock(&saver->lock);
+    while (1) {
+        if (saver->autosaveSeconds > 0 && !saver->stopping) autosaveIfDue(saver);
+        SaveJob *job = saver->first;
+        if (job) {
+            saver->first = job->next;
+            if (!saver->first) saver->last = NULL;
+            saver->writing = 1;
+            pthread_mutex_unlock(&saver->lock);
+            writeSaveJob(job);
+            pthread_mutex_lock(&saver->lock);
+            saver->writing = 0;
+            pthread_cond_broadcast(&saver->changed);
+        } else if (saver->stopping) {
+            break;
+        } else if (saver->autosaveSeconds > 0) {
+            pthread_cond_timedwait(&saver->changed, &saver->lock, &saver->nextAutosave);
+        } else {
+            pthread_cond_wait(&saver->changed, &saver->lock);
+        }
+    }
+    pthread_mutex_unlock(&saver->lock);
+    return NULL;
+}
+
+// Starts the saver thread on first use; saver->lock held
+int startBackgroundSaver(BackgroundSaver *saver) {
+    if (saver->running) return 1;
+    if (pthread_create(&saver->thread, NULL, runBackgroundSaver, saver) != 0) {
+        printf("Error: thread not started in startBackgroundSaver\n");
+        return 0;
+    }
+    saver->running = 1;
+    return 1;
+}
+
+// Has the saver thread write filename from view (SAVE_CONTACTS, SAVE_REPORT or SAVE_SNAPSHOT).
+// The job keeps its own reference to the view, so later changes to the book are not saved.
+// If the thread cannot be started the file is written right away.
+int queueBackgroundSave(BackgroundSaver *saver, BookView *view, const char *filename, int kind) {
+    METRIC_TIMER(started);
+    SaveJob *job = (SaveJob *)malloc(sizeof(SaveJob));
+    if (!job) {
+        printf("Error: Memory allocation failed in queueBackgroundSave\n");
+        return 0;
+    }
+    atomic_fetch_add(&view->refs, 1);
+    job->view = view;
+    job->kind = kind;
+    snprintf(job->filename, sizeof(job->filename), "%s", filename);
+    pthread_mutex_lock(&saver->lock);
+    int queued = startBackgroundSaver(saver);
+    if (queued) pushSaveJob(saver, job);
+    pthread_mutex_unlock(&saver->lock);
+    if (!queued) writeSaveJob(job);
+    METRIC_TIME(METRIC_SAVE_QUEUE, started);
+    return 1;
+}
+
+// Autosaves the book to filename every seconds, skipping the times it did not change since
+// the last autosave; 0 seconds or an empty filename turns autosaving off
+void setAutosave(BackgroundSaver *saver, const char *filename, int seconds) {
+    pthread_mutex_lock(&saver->lock);
+    snprintf(saver->autosaveFile, sizeof(saver->autosaveFile), "%s", filename);
+    saver->autosaveSeconds = seconds > 0 && filename[0] ? seconds : 0;
+    saver->autosaved = 0;
+    clock_gettime(CLOCK_MONOTONIC, &saver->nextAutosave);
+    saver->nextAutosave.tv_sec += saver->autosaveSeconds;
+    if (saver->autosaveSeconds > 0) startBackgroundSaver(saver);
+    pthread_cond_broadcast(&saver->changed);
+    pthread_mutex_unlock(&saver->lock);
+}
+
+// Waits until every queued save is written
+void finishBackgroundSaves(BackgroundSaver *saver) {
+    pthread_mutex_lock(&saver->lock);
+    while (saver->first || saver->writing) pthread_cond_wait(&saver->changed, &saver->lock);
+    pthread_mutex_unlock(&saver->lock);
+}
+
+// Writes the queued saves and stops the thread
+void stopBackgroundSaver(BackgroundSaver *saver) {
+    pthread_mutex_lock(&saver->lock);
+    saver->stopping = 1;
+    pthread_cond_broadcast(&saver->changed);
+    pthread_mutex_unlock(&saver->lock);
+    if (saver->running) pthread_join(saver->thread, NULL);
+    saver->running = 0;
+    pthread_cond_destroy(&saver->changed);
+    pthread_mutex_destroy(&saver->lock);
+}
+
+void positionTableFree(PositionTable *table) {
+    free(table->entries);
+    table->entries = NULL;
+    table->capacity = table->size = 0;
+}
+
+size_t positionTableSlot(const PositionTable *table, const Contact *contact) {
+    unsigned long long hash = (uintptr_t)contact;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return (size_t)hash & (table->capacity - 1);
+}
+
+int positionTableInsert(PositionTable *table, Contact *contact, int position) {
+    if ((table->size + 1) * 2 > table->capacity) {
+        PositionTable grown = {NULL, table->capacity ? table->capacity * 2 : 64, 0};
+        while ((table->size + 1) * 2 > grown.capacity) grown.capacity *= 2;
+        grown.entries = (ContactPosition *)calloc(grown.capacity, sizeof(ContactPosition));
+        if (!grown.entries) {
+            printf("Error: Memory allocation failed in positionTableInsert\n");
+            return 0;
+        }
+        for (size_t i = 0; i < table->capacity; i++) {
+            if (table->entries[i].contact) positionTableInsert(&grown, table->entries[i].contact, table->entries[i].position);
+        }
+        free(table->entries);
+        *table = grown;
+    }
+    size_t mask = table->capacity - 1;
+    size_t i = positionTableSlot(table, contact);
+    while (table->entries[i].contact && table->entries[i].contact != contact) i = (i + 1) & mask;
+    if (!table->entries[i].contact) table->size++;
+    table->entries[i].contact = contact;
+    table->entries[i].position = position;
+    return 1;
+}
+
+int positionTableFind(const PositionTable *table, const Contact *contact) {
+    if (table->capacity == 0) return -1;
+    size_t mask = table->capacity - 1;
+    for (size_t i = positionTableSlot(table, contact); table->entries[i].contact; i = (i + 1) & mask) {
+        if (table->entries[i].contact == contact) return table->entries[i].position;
+    }
+    return -1;
+}
+
+// Queued adds: appended to the vector and indexed in one go
+void appendScriptContacts(ScriptState *state) {
+    AddressBook *book = state->book;
+    Contact **items = state->pending.items;
+    int count = state->pending.count;
+    if (!reserveContacts(book, book->count + count) || !indexContactsMany(book, items, count, NULL)) {
+        printf("Error: %d contacts could not be added in runCommandScript\n", count);
+        state->failed += count;
+        return;
+    }
+    memcpy(dropContactOrder(book) + book->count, items, count * sizeof(Contact *));
+    if (book->journal) {
+        for (int i = 0; i < count; i++) journalInsert(book->journal, book->count + i, items[i]);
+    }
+    book->count += count;
+}
+
+// Queued alphabetical inserts: a sorted book takes them in one merge, equal names keeping
+// command order behind the book's own, which is what inserting them one by one gives
+void insertScriptContacts(ScriptState *state) {
+    AddressBook *book = state->book;
+    Contact **items = state->pending.items;
+    int count = state->pending.count;
+    if (!isSortedByName(book)) {
+        // Insertion points in an unsorted book depend on its order, insert one at a time
+        markSortedIndexesStale(book);
+        dropContactOrder(book);
+        for (int i = 0; i < count; i++) {
+            int position = 0;
+            while (position < book->count && compareContactNames(items[i], book->contacts[position]) >= 0) position++;
+            if (!insertContactAt(book, position, items[i])) state->failed++;
+        }
+        return;
+    }
+    ContactPosition *order = (ContactPosition *)malloc(count * sizeof(ContactPosition));
+    if (!order) {
+        printf("Error: Memory allocation failed in runCommandScript\n");
+        state->failed += count;
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        order[i].contact = items[i];
+        order[i].position = i;
+    }
+    qsort(order, count, sizeof(ContactPosition), compareNamesThenPosition);
+    for (int i = 0; i < count; i++) items[i] = order[i].contact;
+    free(order);
+    if (!indexContactsMany(book, items, count, NULL)) {
+        state->failed += count;
+    } else if (!mergeSortedBatch(book, items, count)) {
+        for (int i = 0; i < count; i++) unindexContact(book, items[i]);
+        state->failed += count;
+    }
+}
+
+// Queued removals: one pass over the vector drops, for every name, as many of its first
+// contacts as there were commands for it, which is what removing them one by one gives
+void removeScriptContacts(ScriptState *state) {
+    AddressBook *book = state->book;
+    HashIndex wanted = {NULL, 0, 0, 0};
+    for (int i = 0; i < state->pending.count; i++) {
+        ScriptRemoval *removal = (ScriptRemoval *)state->pending.items[i];
+        removal->remaining = 0;
+        Contact *same = nameIndexFind(&wanted, removal->key.firstName, removal->key.familyName);
+        if (same) {
+            ((ScriptRemoval *)same)->remaining++;
+        } else if (nameIndexFind(bookNames(book), removal->key.firstName, removal->key.familyName) &&
+                   nameIndexInsert(&wanted, &removal->key)) {
+            removal->remaining = 1;
+        } else {
+            printf("Error: contact '%s %s' not found on line %d in runCommandScript\n",
+                   removal->key.firstName, removal->key.familyName, removal->line);
+            state->failed++;
+        }
+    }
+    if (wanted.size > 0) {
+        markSortedIndexesStale(book);
+        Contact **contacts = dropContactOrder(book);
+        int kept = 0;
+        for (int i = 0; i < book->count; i++) {
+            Contact *contact = contacts[i];
+            ScriptRemoval *removal = (ScriptRemoval *)nameIndexFind(&wanted, contact->firstName, contact->familyName);
+            if (removal && removal->remaining > 0) {
+                removal->remaining--;
+                unindexContact(book, contact);
+                if (book->journal) journalDelete(book->journal, kept);
+            } else {
+                contacts[kept++] = contact;
+            }
+        }
+        book->count = kept;
+        for (int i = 0; i < state->pending.count; i++) {
+            ScriptRemoval *removal = (ScriptRemoval *)state->pending.items[i];
+            if (removal->remaining > 0) {
+                printf("Error: contact '%s %s' not found on line %d in runCommandScript\n",
+                       removal->key.firstName, removal->key.familyName, removal->line);
+                state->failed += removal->remaining;
+            }
+        }
+    }
+    hashIndexFree(&wanted);
+}
+
+// Applies the queued commands and forgets the positions learned by a run of edits
+void flushScript(ScriptState *state) {
+    if (state->pending.count > 0) {
+        if (state->kind == SCRIPT_ADD) appendScriptContacts(state);
+        else if (state->kind == SCRIPT_INSERT) insertScriptContacts(state);
+        else if (state->kind == SCRIPT_REMOVE) removeScriptContacts(state);
+    }
+    state->pending.count = 0;
+    state->kind = SCRIPT_NONE;
+    positionTableFree(&state->positions);
+}
+
+// Position of contact in the book; the table is filled once per run of edits, which never
+// move contacts (the copies they make are added as they are made)
+int scriptPositionOf(ScriptState *state, Contact *contact) {
+    AddressBook *book = state->book;
+    if (state->positions.capacity == 0) {
+        Contact **contacts = bookContacts(book);
+        for (int i = 0; i < book->count; i++) {
+            if (!positionTableInsert(&state->positions, contacts[i], i)) {
+                positionTableFree(&state->positions);
+                return -1;
+            }
+        }
+    }
+    return positionTableFind(&state->positions, contact);
+}
+
+// Runs a file of tab-separated commands, one per line, without prompting:
+//   add     first, family, address, phone, age   (like menu option 1)
+//   insert  first, family, address, phone, age   (like menu option 2)
+//   remove  first, family                        (first contact with that name)
+//   edit    first, family, field, value          (field: first, family, address, phone or age)
+//   load / append / merge / save  filename
+// Empty lines and lines starting with # are skipped. Consecutive adds, inserts or removals
+// are queued and applied as one batch, so the vector and the indexes are updated once per
+// run of commands instead of once per command; edits apply at once with the sorted indexes
+// left to be rebuilt by the next prefix query.
+int runCommandScript(AddressBook *book, char *filename) {
+    char *data;
+    size_t size;
+    int mapped;
+    if (!openInputFile(filename, &data, &size, &mapped, "runCommandScript")) return 0;
+    ScriptState state;
+    memset(&state, 0, sizeof(state));
+    state.book = book;
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    const char *cursor = data;
+    const char *end = data + size;
+    int line = 0;
+    while (cursor < end) {
+        const char *newline = (const char *)memchr(cursor, '\n', end - cursor);
+        const char *lineEnd = newline ? newline : end;
+        const char *lineStart = cursor;
+        cursor = newline ? newline + 1 : end;
+        line++;
+        if (lineEnd > lineStart && lineEnd[-1] == '\r') lineEnd--;
+        if (lineEnd == lineStart || *lineStart == '#') continue;
+
+        const char *fields[7];
+        size_t lengths[7];
+        int fieldCount = 0;
+        for (const char *field = lineStart; fieldCount < 7;) {
+            const char *tab = (const char *)memchr(field, '\t', lineEnd - field);
+            fields[fieldCount] = field;
+            lengths[fieldCount++] = (tab ? tab : lineEnd) - field;
+            if (!tab) break;
+            field = tab + 1;
+        }
+        state.commands++;
+        int kind = SCRIPT_NONE;
+        if (lengths[0] == 3 && memcmp(fields[0], "add", 3) == 0) kind = SCRIPT_ADD;
+        else if (lengths[0] == 6 && memcmp(fields[0], "insert", 6) == 0) kind = SCRIPT_INSERT;
+        else if (lengths[0] == 6 && memcmp(fields[0], "remove", 6) == 0) kind = SCRIPT_REMOVE;
+        else if (lengths[0] == 4 && memcmp(fields[0], "edit", 4) == 0) kind = SCRIPT_EDIT;
+        if (kind != state.kind) flushScript(&state);
+
+        if (kind == SCRIPT_ADD || kind == SCRIPT_INSERT) {
+            long long phoneNum, age;
+            if (fieldCount != 6 || !parsePhoneDigits(fields[4], lengths[4], &phoneNum) ||
+                !parseAgeDigits(fields[5], lengths[5], &age)) {
+                printf("Error: invalid contact on line %d in runCommandScript\n", line);
+                state.failed++;
+                continue;
+            }
+            Contact *contact = (Contact *)arenaAlloc(&book->storage, sizeof(Contact));
+            if (!contact) {
+                state.failed++;
+                continue;
+            }
+            contact->firstName = storeString(&book->storage, bookStrings(book), fields[1], lengths[1]);
+            contact->familyName = storeString(&book->storage, bookStrings(book), fields[2], lengths[2]);
+            contact->phoneNum = phoneNum;
+            contact->age = (int)age;
+            if (!contact->firstName || !contact->familyName ||
+                !storeAddress(&book->storage, bookStrings(book), contact, fields[3], lengths[3]) ||
+                !addToBatch(&state.pending, contact)) {
+                state.failed++;
+                continue;
+            }
+            state.kind = kind;
+        } else if (kind == SCRIPT_REMOVE) {
+            if (fieldCount != 3) {
+                printf("Error: remove needs a first and a family name on line %d in runCommandScript\n", line);
+                state.failed++;
+                continue;
+            }
+            ScriptRemoval *removal = (ScriptRemoval *)arenaAlloc(&state.scratch, sizeof(ScriptRemoval));
+            if (!removal) {
+                state.failed++;
+                continue;
+            }
+            removal->key.firstName = arenaStrndup(&state.scratch, fields[1], lengths[1]);
+            removal->key.familyName = arenaStrndup(&state.scratch, fields[2], lengths[2]);
+            removal->line = line;
+            if (!removal->key.firstName || !removal->key.familyName || !addToBatch(&state.pending, &removal->key)) {
+                state.failed++;
+                continue;
+            }
+            state.kind = kind;
+        } else if (kind == SCRIPT_EDIT) {
+            static const char *const fieldNames[] = {"", "first", "family", "address", "phone", "age"};
+            int field = 0;
+            for (int i = CONTACT_FIELD_FIRST_NAME; fieldCount == 5 && i <= CONTACT_FIELD_AGE; i++) {
+                if (lengths[3] == strlen(fieldNames[i]) && memcmp(fields[3], fieldNames[i], lengths[3]) == 0) field = i;
+            }
+            long long number = 0;
+            char *text = NULL;
+            if (field == CONTACT_FIELD_PHONE) {
+                if (!parsePhoneDigits(fields[4], lengths[4], &number)) field = 0;
+            } else if (field == CONTACT_FIELD_AGE) {
+                if (!parseAgeDigits(fields[4], lengths[4], &number)) field = 0;
+            } else if (field != 0) {
+                text = storeEditText(book, field, fields[4], lengths[4], &number);
+                if (!text) field = 0;
+            }
+            if (field == 0) {
+                printf("Error: invalid edit on line %d in runCommandScript\n", line);
+                state.failed++;
+                continue;
+            }
+            char *firstName = arenaStrndup(&state.scratch, fields[1], lengths[1]);
+            char *familyName = arenaStrndup(&state.scratch, fields[2], lengths[2]);
+            ContactBatch matches = {NULL, 0, 0};
+            if (firstName && familyName) nameIndexFindAll(bookNames(book), firstName, familyName, &matches);
+            // The first match in book order
+            int position = -1;
+            for (int i = 0; i < matches.count; i++) {
+                int at = scriptPositionOf(&state, matches.items[i]);
+                if (at >= 0 && (position < 0 || at < position)) position = at;
+            }
+            free(matches.items);
+            if (position < 0) {
+                printf("Error: contact '%s %s' not found on line %d in runCommandScript\n",
+                       firstName ? firstName : "", familyName ? familyName : "", line);
+                state.failed++;
+                continue;
+            }
+            markSortedIndexesStale(book);
+            Contact *contact = setContactField(book, position, field, text, number);
+            if (!positionTableInsert(&state.positions, contact, position)) positionTableFree(&state.positions);
+            state.kind = kind;
+        } else {
+            char *path = fieldCount == 2 ? arenaStrndup(&state.scratch, fields[1], lengths[1]) : NULL;
+            int ok = 0;
+            if (!path) {
+                printf("Error: unknown command on line %d in runCommandScript\n", line);
+            } else if (lengths[0] == 4 && memcmp(fields[0], "load", 4) == 0) {
+                ok = 1;
+                loadContactsFromFile(book, path);
+            } else if (lengths[0] == 6 && memcmp(fields[0], "append", 6) == 0) {
+                ok = 1;
+                appendContactsFromFile(book, path);
+            } else if (lengths[0] == 5 && memcmp(fields[0], "merge", 5) == 0) {
+                ok = 1;
+                mergeContactsFromFile(book, path);
+            } else if (lengths[0] == 4 && memcmp(fields[0], "save", 4) == 0) {
+                ok = saveContactsToFile(book, path);
+            } else {
+                printf("Error: unknown command on line %d in runCommandScript\n", line);
+            }
+            if (!ok) state.failed++;
+        }
+    }
+    flushScript(&state);
+    METRIC_TIME(METRIC_SCRIPT, started);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    int applied = state.commands - state.failed;
+    printf("%d of %d script commands applied in %.3f s (%.0f operations per second)\n", applied,
+           state.commands, seconds, seconds > 0 ? state.commands / seconds : 0.0);
+    free(state.pending.items);
+    arenaFree(&state.scratch);
+    releaseInputFile(data, size, mapped);
+    return applied;
+}
+
+#define GENERATOR_DEFAULT_COLLISIONS 5
+#define GENERATOR_DEFAULT_NAME_LENGTH 8
+#define GENERATOR_DEFAULT_ADDRESS_LENGTH 24
+#define GENERATOR_DEFAULT_SEED 1
+// Longest generated field: generatorLength draws up to 3/2 of the mean, and a short family
+// name still takes its record-number suffix
+#define GENERATOR_FIELD_SIZE (3 * GENERATOR_MAX_LENGTH / 2 + 10)
+#define GENERATOR_BUFFER_SIZE (3 * GENERATOR_FIELD_SIZE + 16) // strings of one generated contact
+
+// Next value of a splitmix64 stream
+uint64_t nextRandom(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Start of the random stream for one part of a record: 0 decides collisions, 1 the name, 2 the rest
+uint64_t recordRandomState(const GeneratorOptions *options, long long record, int part) {
+    return options->seed * 0xd1b54a32d192ed03ULL + (uint64_t)record * 4 + part;
+}
+
+// Record whose name this one has: itself, or for a collision the earlier record it copies,
+// followed back to one that has a name of its own
+long long generatorNameRecord(const GeneratorOptions *options, long long record) {
+    while (record > 0) {
+        uint64_t state = recordRandomState(options, record, 0);
+        if (nextRandom(&state) % 100 >= (uint64_t)options->collisionPercent) break;
+        record = (long long)(nextRandom(&state) % (uint64_t)record);
+    }
+    return record;
+}
+
+// Field length drawn evenly from half to one and a half times the mean
+int generatorLength(uint64_t *state, int mean) {
+    return mean - mean / 2 + (int)(nextRandom(state) % (uint64_t)(mean + 1));
+}
+
+// Capital letter followed by lowercase ones. Only the first room letters are stored; the rest
+// are still drawn, so what follows in the record does not depend on where a word was cut.
+char *putRandomWord(char *out, uint64_t *state, int length, int room) {
+    for (int i = 0; i < length; i++) {
+        char letter = (char)((i == 0 ? 'A' : 'a') + nextRandom(state) % 26);
+        if (i < room) *out++ = letter;
+    }
+    return out;
+}
+
+// Fills contact with the given record, its strings stored in buffer (GENERATOR_BUFFER_SIZE bytes)
+void generateContact(const GeneratorOptions *options, long long record, Contact *contact, char *buffer) {
+    long long nameRecord = generatorNameRecord(options, record);
+    uint64_t state = recordRandomState(options, nameRecord, 1);
+    char *out = buffer;
+    contact->firstName = out;
+    int length = generatorLength(&state, options->nameLength);
+    out = putRandomWord(out, &state, length, length);
+    *out++ = '\0';
+
+    // The family name ends in its record number as capital letters, so names only repeat by collision
+    char suffix[16];
+    int digits = 0;
+    long long number = nameRecord;
+    do {
+        suffix[digits++] = (char)('A' + number % 26);
+        number /= 26;
+    } while (number > 0);
+    length = generatorLength(&state, options->nameLength) - digits;
+    contact->familyName = out;
+    if (length < 1) length = 1;
+    out = putRandomWord(out, &state, length, length);
+    while (digits > 0) *out++ = suffix[--digits];
+    *out++ = '\0';
+
+    state = recordRandomState(options, record, 2);
+    contact->address = out;
+    length = generatorLength(&state, options->addressLength);
+    out += formatInteger(out, (long long)(1 + nextRandom(&state) % 9999));
+    while (out - contact->address < length) {
+        *out++ = ' ';
+        out = putRandomWord(out, &state, 3 + (int)(nextRandom(&state) % 6), length - (int)(out - contact->address));
+    }
+    if (out - contact->address > length) out = contact->address + length; // a house number longer than length
+    if (out[-1] == ' ') out--;
+    *out = '\0';
+    contact->addressNumber = 0;
+    contact->phoneNum = 1000000000LL + (long long)(nextRandom(&state) % 9000000000ULL);
+    contact->age = 1 + (int)(nextRandom(&state) % 100);
+}
+
+// Writes options->count synthetic contacts in the saveContactsToFile format; -1 on failure
+long long generateContacts(const GeneratorOptions *options, char *filename) {
+    if (options->count < 0 || options->first < 0 || options->collisionPercent < 0 ||
+        options->collisionPercent > 100 || options->nameLength < 1 || options->nameLength > GENERATOR_MAX_LENGTH ||
+        options->addressLength < 1 || options->addressLength > GENERATOR_MAX_LENGTH) {
+        printf("Error: invalid options in generateContacts\n");
+        return -1;
+    }
+    // Written like a save, so an existing file is only replaced by a complete one
+    char tempPath[PATH_MAX];
+    int fd = createTempFile(tempPath, filename, "generateContacts");
+    if (fd < 0) return -1;
+    OutBuf out;
+    char buffer[GENERATOR_BUFFER_SIZE];
+    Contact contact;
+    int ok = outBufInit(&out, fd, OUTPUT_BUFFER_SIZE);
+    for (long long i = 0; ok && i < options->count; i++) {
+        generateContact(options, options->first + i, &contact, buffer);
+        outBufPutContact(&out, &contact, 0, CONTACT_FORMAT_SAVE);
+        ok = !out.failed;
+    }
+    ok = ok && outBufFlush(&out) && fsync(fd) == 0;
+    outBufFree(&out);
+    if (close(fd) != 0) ok = 0;
+    if (!ok) printf("Error: writing failed in generateContacts\n");
+    else METRIC_ADD(METRIC_FSYNCS, 1);
+    if (!replaceWithTempFile(tempPath, filename, ok, "generateContacts")) return -1;
+    printf("%lld contacts were written to %s\n", options->count, filename);
+    return options->count;
+}
+
+#define BENCH_DEFAULT_SIZES {1000, 10000, 100000, 1000000, 10000000}
+#define BENCH_BULK_WORK 10000000     // contacts loaded, saved, ... per bulk operation and size
+#define BENCH_MIN_REPEATS 3
+#define BENCH_MAX_REPEATS 50
+#define BENCH_SINGLE_WORK 100000000  // contacts shifted or compared per single-contact operation
+#define BENCH_MIN_OPERATIONS 50
+#define BENCH_PREFIX_LENGTH 3        // family name characters searched for by find-prefix
+#define BENCH_FUZZY_DISTANCE 2       // edits allowed by the fuzzy queries, which are one edit away
+#define BENCH_FILTER_MIN_AGE 30      // ages kept by the filter benchmark
+#define BENCH_FILTER_MAX_AGE 49
+
+// Bulk operations timed by benchBulk, in the order they run
+enum {
+    BENCH_LOAD,
+    BENCH_SAVE,
+    BENCH_LIST,
+    BENCH_PRINT,
+    BENCH_APPEND,
+    BENCH_MERGE,
+    BENCH_SNAPSHOT_SAVE,
+    BENCH_SNAPSHOT_LOAD
+};
+
+const char *benchOperationNames[] = {"load", "save", "list", "print", "append", "merge", "snapshot-save",
+                                     "snapshot-load"};
+
+// Starts a new peak RSS measurement; 0 where the high-water mark cannot be reset (not Linux)
+int resetPeakRss(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0) return 0;
+    int reset = write(fd, "5", 1) == 1;
+    close(fd);
+    return reset;
+}
+
+// Peak resident set size in kB since resetPeakRss, or since the start where it was not reset
+long peakRssKb(void) {
+    long peak = -1;
+    char line[256];
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status) {
+        while (fgets(line, sizeof(line), status)) {
+            if (strncmp(line, "VmHWM:", 6) == 0) {
+                peak = strtol(line + 6, NULL, 10);
+                break;
+            }
+        }
+        fclose(status);
+    }
+    if (peak < 0) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        peak = usage.ru_maxrss;
+    }
+    return peak;
+}
+
+double secondsSince(const struct timespec *started) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - started->tv_sec) + (now.tv_nsec - started->tv_nsec) / 1e9;
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int compareInts(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+void benchStart(BenchResult *result, const char *operation, int contacts, long long items) {
+    result->operation = operation;
+    result->contacts = contacts;
+    result->items = items;
+    result->count = 0;
+    result->recall = -1;
+    resetPeakRss();
+}
+
+void benchAdd(BenchResult *result, double seconds) {
+    if (result->count < BENCH_MAX_SAMPLES) result->seconds[result->count++] = seconds;
+}
+
+// Nearest-rank percentile of sorted samples
+double percentile(const double *sorted, int count, int percent) {
+    int rank = (count * percent + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// Writes one result as an element of the "results" array
+void benchReport(FILE *report, BenchResult *result, int *first) {
+    if (result->count == 0) return;
+    double *seconds = result->seconds;
+    double total = 0;
+    qsort(seconds, result->count, sizeof(double), compareDoubles);
+    for (int i = 0; i < result->count; i++) total += seconds[i];
+    fprintf(report, "%s\n    {\"operation\": \"%s\", \"contacts\": %d, \"samples\": %d, \"itemsPerSample\": %lld, "
+            "\"throughputPerSecond\": %.1f, \"latencySeconds\": {\"min\": %.9f, \"mean\": %.9f, \"p50\": %.9f, "
+            "\"p90\": %.9f, \"p99\": %.9f, \"max\": %.9f}, \"peakRssKb\": %ld",
+            *first ? "" : ",", result->operation, result->contacts, result->count, result->items,
+            total > 0 ? result->items * result->count / total : 0.0, seconds[0], total / result->count,
+            percentile(seconds, result->count, 50), percentile(seconds, result->count, 90),
+            percentile(seconds, result->count, 99), seconds[result->count - 1], peakRssKb());
+    if (result->recall >= 0) fprintf(report, ", \"recall\": %.4f", result->recall);
+    fprintf(report, "}");
+    fflush(report);
+    *first = 0;
+}
+
+// Times a bulk operation repeats times; with startFile the book is loaded from it before each run
+void benchBulk(FILE *report, AddressBook *book, int operation, int contacts, long long items, int repeats,
+               char *startFile, char *file, int *first) {
+    BenchResult result;
+    struct timespec started;
+    benchStart(&result, benchOperationNames[operation], contacts, items);
+    for (int r = 0; r < repeats; r++) {
+        if (startFile) loadContactsFromFile(book, startFile);
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        switch (operation) {
+            case BENCH_LOAD: loadContactsFromFile(book, file); break;
+            case BENCH_SAVE: saveContactsToFile(book, file); break;
+            case BENCH_LIST: listContacts(book); break;
+            case BENCH_PRINT: printContactsToFile(book, file); break;
+            case BENCH_APPEND: appendContactsFromFile(book, file); break;
+            case BENCH_MERGE: mergeContactsFromFile(book, file); break;
+            case BENCH_SNAPSHOT_SAVE: saveSnapshotToFile(book, file); break;
+            case BENCH_SNAPSHOT_LOAD: loadSnapshotFromFile(book, file); break;
+        }
+        benchAdd(&result, secondsSince(&started));
+    }
+    benchReport(report, &result, first);
+}
+
+// Whether two files have the same bytes
+int sameFileContents(char *fileA, char *fileB) {
+    char *dataA, *dataB;
+    size_t sizeA, sizeB;
+    int mappedA, mappedB;
+    if (!openInputFile(fileA, &dataA, &sizeA, &mappedA, "sameFileContents")) return 0;
+    if (!openInputFile(fileB, &dataB, &sizeB, &mappedB, "sameFileContents")) {
+        releaseInputFile(dataA, sizeA, mappedA);
+        return 0;
+    }
+    int same = sizeA == sizeB && (sizeA == 0 || memcmp(dataA, dataB, sizeA) == 0);
+    releaseInputFile(dataA, sizeA, mappedA);
+    releaseInputFile(dataB, sizeB, mappedB);
+    return same;
+}
+
+// Sends stdout to /dev/null, so the operations' own messages stay out of a JSON report, and
+// returns a stream to the original stdout for the report; NULL on failure
+FILE *openReport(const char *caller) {
+    fflush(stdout);
+    int reportFd = dup(STDOUT_FILENO);
+    int nullFd = open("/dev/null", O_WRONLY);
+    FILE *report = reportFd >= 0 ? fdopen(reportFd, "w") : NULL;
+    if (!report || nullFd < 0) {
+        printf("Error: output could not be redirected in %s\n", caller);
+        if (report) fclose(report);
+        else if (reportFd >= 0) close(reportFd);
+        if (nullFd >= 0) close(nullFd);
+        return NULL;
+    }
+    dup2(nullFd, STDOUT_FILENO);
+    close(nullFd);
+    return report;
+}
+
+// Puts stdout back where openReport found it
+void closeReport(FILE *report) {
+    fflush(stdout);
+    fflush(report);
+    dup2(fileno(report), STDOUT_FILENO);
+    fclose(report);
+}
+
+// The single-contact paths from before the order tree, kept as a baseline for --bench: a scan
+// of the vector for the position, then a shift of its tail
+void benchInsertInVector(AddressBook *book, Contact *contact) {
+    Contact **contacts = dropContactOrder(book);
+    int i = 0;
+    while (i < book->count && compareContactNames(contact, contacts[i]) >= 0) i++;
+    insertContactAt(book, i, contact);
+}
+
+void benchRemoveFromVector(AddressBook *book, const char *firstName, const char *familyName) {
+    Contact **contacts = dropContactOrder(book);
+    for (int i = 0; i < book->count; i++) {
+        if (strcmp(contacts[i]->firstName, firstName) == 0 && strcmp(contacts[i]->familyName, familyName) == 0) {
+            deleteContactAt(book, i);
+            return;
+        }
+    }
+}
+
+// Benchmarks one book size on generated files; the caller removes them afterwards
+int benchSize(FILE *report, int size, char *baseFile, char *moreFile, char *sortedFile, char *outputFile,
+              char *snapshotFile, int *first) {
+    GeneratorOptions options = {0, size, GENERATOR_DEFAULT_COLLISIONS, GENERATOR_DEFAULT_NAME_LENGTH,
+                                GENERATOR_DEFAULT_ADDRESS_LENGTH, GENERATOR_DEFAULT_SEED};
+    int more = size / 10 > 0 ? size / 10 : 1;
+    if (generateContacts(&options, baseFile) < 0) return 0;
+    // The imported file continues the book, so its collisions include names already in the book
+    options.first = size;
+    options.count = more;
+    if (generateContacts(&options, moreFile) < 0) return 0;
+    int repeats = BENCH_BULK_WORK / size;
+    if (repeats < BENCH_MIN_REPEATS) repeats = BENCH_MIN_REPEATS;
+    if (repeats > BENCH_MAX_REPEATS) repeats = BENCH_MAX_REPEATS;
+    int operations = BENCH_SINGLE_WORK / size;
+    if (operations < BENCH_MIN_OPERATIONS) operations = BENCH_MIN_OPERATIONS;
+    if (operations > BENCH_MAX_SAMPLES) operations = BENCH_MAX_SAMPLES;
+
+    AddressBook book;
+    if (!initAddressBook(&book)) return 0;
+    benchBulk(report, &book, BENCH_LOAD, size, size, repeats, NULL, baseFile, first);
+    if (book.count != size) {
+        fprintf(stderr, "Error: %d of %d contacts loaded in runBenchmarks\n", book.count, size);
+        freeAddressBook(&book);
+        return 0;
+    }
+    // The other operations start from a sorted book, so merges and inserts take their usual path
+    qsort(dropContactOrder(&book), book.count, sizeof(Contact *), compareContactPointers);
+    markSortedIndexesStale(&book);
+    if (!saveContactsToFile(&book, sortedFile)) {
+        fprintf(stderr, "Error: sorted book not saved in runBenchmarks\n");
+        freeAddressBook(&book);
+        return 0;
+    }
+    benchBulk(report, &book, BENCH_SAVE, size, size, repeats, NULL, outputFile, first);
+    benchBulk(report, &book, BENCH_SNAPSHOT_SAVE, size, size, repeats, NULL, snapshotFile, first);
+    benchBulk(report, &book, BENCH_SNAPSHOT_LOAD, size, size, repeats, NULL, snapshotFile, first);
+    // Round trip check: the book loaded back from the snapshot saves as the same text
+    if (!saveContactsToFile(&book, outputFile) || !sameFileContents(sortedFile, outputFile)) {
+        fprintf(stderr, "Error: text saved from the snapshot differs from the original in runBenchmarks\n");
+        freeAddressBook(&book);
+        return 0;
+    }
+    benchBulk(report, &book, BENCH_LIST, size, size, repeats, NULL, NULL, first);
+    benchBulk(report, &book, BENCH_PRINT, size, size, repeats, NULL, outputFile, first);
+    benchBulk(report, &book, BENCH_APPEND, size, more, repeats, sortedFile, moreFile, first);
+    benchBulk(report, &book, BENCH_MERGE, size, more, repeats, sortedFile, moreFile, first);
+
+    // The same merge streamed through run files, which must give the file the merge saves
+    BenchResult result;
+    struct timespec started;
+    benchStart(&result, "stream-merge", size, more);
+    for (int r = 0; r < repeats; r++) {
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        mergeFilesStreaming(sortedFile, moreFile, outputFile, (size_t)STREAM_DEFAULT_MEMORY_MB << 20);
+        benchAdd(&result, secondsSince(&started));
+    }
+    benchReport(report, &result, first);
+    if (!saveContactsToFile(&book, baseFile) || !sameFileContents(baseFile, outputFile)) {
+        fprintf(stderr, "Error: streamed merge differs from the merge in runBenchmarks\n");
+        freeAddressBook(&book);
+        return 0;
+    }
+
+    // Lookups of contacts already in the book, through the indexes and by scanning every contact
+    // as the old menu did. Each scan is checked against the index for the same query. The first
+    // prefix query after a load sorts the index and is reported on its own.
+    loadContactsFromFile(&book, sortedFile);
+    BookView scan = {0};
+    scan.contacts = bookContacts(&book);
+    scan.count = book.count;
+    ContactBatch found = {NULL, 0, 0};
+    char prefix[BENCH_PREFIX_LENGTH + 1];
+    snprintf(prefix, sizeof(prefix), "%s", bookContactAt(&book, 0)->familyName);
+    benchStart(&result, "find-prefix-first", size, 1);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    findContactsByPrefix(&book, prefix, 0, &found);
+    benchAdd(&result, secondsSince(&started));
+    benchReport(report, &result, first);
+    static const char *const findOperations[] = {"find-phone", "find-phone-scan", "find-prefix", "find-prefix-scan"};
+    int mismatches = 0;
+    for (int kind = 0; kind < 4; kind++) {
+        uint64_t state = options.seed;
+        benchStart(&result, findOperations[kind], size, 1);
+        for (int i = 0; i < operations; i++) {
+            Contact *contact = bookContactAt(&book, nextRandom(&state) % (uint64_t)book.count);
+            snprintf(prefix, sizeof(prefix), "%s", contact->familyName);
+            found.count = 0;
+            clock_gettime(CLOCK_MONOTONIC, &started);
+            int count = 0;
+            switch (kind) {
+                case 0: count = findContactsByPhone(&book, contact->phoneNum, &found); break;
+                case 1: count = findViewContactsByPhone(&scan, contact->phoneNum, &found); break;
+                case 2: count = findContactsByPrefix(&book, prefix, 0, &found); break;
+                case 3: count = findViewContactsByPrefix(&scan, prefix, 0, &found); break;
+            }
+            benchAdd(&result, secondsSince(&started));
+            if (kind == 1 || kind == 3) {
+                found.count = 0;
+                int indexed = kind == 1 ? findContactsByPhone(&book, contact->phoneNum, &found)
+                                        : findContactsByPrefix(&book, prefix, 0, &found);
+                if (indexed != count) mismatches++;
+            }
+        }
+        benchReport(report, &result, first);
+    }
+    free(found.items);
+    if (mismatches > 0) {
+        fprintf(stderr, "Error: %d indexed lookups differ from a scan in runBenchmarks\n", mismatches);
+        freeAddressBook(&book);
+        return 0;
+    }
+
+    // Fuzzy search of full names with one character changed, through the trigram index and by
+    // scanning every contact; the first query builds the index. Recall is the share of the
+    // scan's matches the index also returned, ranked the same way, so it should be 1.
+    FuzzyMatch matches[FUZZY_LIST_LIMIT], scanMatches[FUZZY_LIST_LIMIT];
+    char query[512];
+    BenchResult scanResult;
+    long long scanFound = 0, alsoFound = 0;
+    uint64_t fuzzyState = options.seed;
+    for (int i = 0; i <= operations; i++) {
+        Contact *contact = bookContactAt(&book, nextRandom(&fuzzyState) % (uint64_t)book.count);
+        int length = snprintf(query, sizeof(query), "%s %s", contact->firstName, contact->familyName);
+        if (length >= (int)sizeof(query)) length = (int)sizeof(query) - 1;
+        int position = (int)(nextRandom(&fuzzyState) % (uint64_t)length);
+        query[position] = query[position] == 'q' ? 'x' : 'q';
+        if (i == 0) benchStart(&result, "fuzzy-first", size, 1);
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        int count = findContactsFuzzy(&book, FUZZY_FULL_NAME, query, BENCH_FUZZY_DISTANCE, FUZZY_LIST_LIMIT, matches);
+        benchAdd(&result, secondsSince(&started));
+        if (i == 0) {
+            benchReport(report, &result, first);
+            benchStart(&result, "fuzzy", size, 1);
+            benchStart(&scanResult, "fuzzy-scan", size, 1);
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        int scanCount = findViewContactsFuzzy(&scan, FUZZY_FULL_NAME, query, BENCH_FUZZY_DISTANCE, FUZZY_LIST_LIMIT,
+                                              scanMatches);
+        benchAdd(&scanResult, secondsSince(&started));
+        scanFound += scanCount;
+        for (int j = 0; j < scanCount; j++) {
+            for (int k = 0; k < count; k++) {
+                if (matches[k].contact == scanMatches[j].contact) {
+                    alsoFound++;
+                    break;
+                }
+            }
+        }
+    }
+    result.recall = scanFound > 0 ? (double)alsoFound / scanFound : 1;
+    benchReport(report, &result, first);
+    benchReport(report, &scanResult, first);
+
+    // Filter by an age range over the columns and row by row, after a first filter builds the
+    // columns; both must find the same contacts
+    ContactFilter filter = {BENCH_FILTER_MIN_AGE, BENCH_FILTER_MAX_AGE, LLONG_MIN, LLONG_MAX, NULL};
+    ContactAggregate aggregate, scanAggregate;
+    findContactsByFilter(&book, &filter, NULL, &aggregate);
+    benchStart(&result, "filter", size, size);
+    benchStart(&scanResult, "filter-scan", size, size);
+    for (int r = 0; r < repeats; r++) {
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        findContactsByFilter(&book, &filter, NULL, &aggregate);
+        benchAdd(&result, secondsSince(&started));
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        filterContacts(bookContacts(&book), book.count, &filter, NULL, &scanAggregate);
+        benchAdd(&scanResult, secondsSince(&started));
+        if (aggregate.count != scanAggregate.count || aggregate.ageSum != scanAggregate.ageSum) mismatches++;
+    }
+    benchReport(report, &result, first);
+    benchReport(report, &scanResult, first);
+    if (mismatches > 0) {
+        fprintf(stderr, "Error: %d column filters differ from a scan in runBenchmarks\n", mismatches);
+        freeAddressBook(&book);
+        return 0;
+    }
+
+    // Single contacts: new names inserted in place, then names already in the book removed. The
+    // same operations run on the vector as before the order tree, then through the tree after
+    // timing its build; both start from the sorted book.
+    static const char *const insertOperations[] = {"insert-alphabetical-vector", "insert-alphabetical"};
+    static const char *const removeOperations[] = {"remove-by-name-vector", "remove-by-name"};
+    for (int tree = 0; tree < 2; tree++) {
+        loadContactsFromFile(&book, sortedFile);
+        if (tree) {
+            benchStart(&result, "order-build", size, size);
+            clock_gettime(CLOCK_MONOTONIC, &started);
+            useContactOrder(&book);
+            benchAdd(&result, secondsSince(&started));
+            benchReport(report, &result, first);
+        }
+        benchStart(&result, insertOperations[tree], size, 1);
+        for (int i = 0; i < operations; i++) {
+            Contact *contact = (Contact *)arenaAlloc(&book.storage, sizeof(Contact));
+            char *buffer = (char *)arenaAlloc(&book.storage, GENERATOR_BUFFER_SIZE);
+            if (!contact || !buffer) break;
+            generateContact(&options, (long long)size + more + i, contact, buffer);
+            clock_gettime(CLOCK_MONOTONIC, &started);
+            if (tree) insertContactAlphabetical(&book, contact);
+            else benchInsertInVector(&book, contact);
+            benchAdd(&result, secondsSince(&started));
+        }
+        benchReport(report, &result, first);
+        uint64_t state = options.seed;
+        benchStart(&result, removeOperations[tree], size, 1);
+        for (int i = 0; i < operations && book.count > 0; i++) {
+            // The removed contact's strings stay in the arena until the book is freed
+            Contact *contact = bookContactAt(&book, nextRandom(&state) % (uint64_t)book.count);
+            clock_gettime(CLOCK_MONOTONIC, &started);
+            if (tree) removeContactByName(&book, contact->firstName, contact->familyName);
+            else benchRemoveFromVector(&book, contact->firstName, contact->familyName);
+            benchAdd(&result, secondsSince(&started));
+        }
+        benchReport(report, &result, first);
+    }
+
+    // Journaled appends at each fsync policy, committed once per append as the menu does
+    static const char *const journalOperations[] = {"journal-append-always", "journal-append-batch",
+                                                    "journal-append-never"};
+    for (int policy = JOURNAL_FSYNC_ALWAYS; policy <= JOURNAL_FSYNC_NEVER; policy++) {
+        if (!openJournal(&book, sortedFile, policy)) {
+            fprintf(stderr, "Error: journal not opened in runBenchmarks\n");
+            freeAddressBook(&book);
+            return 0;
+        }
+        benchStart(&result, journalOperations[policy], size, 1);
+        for (int i = 0; i < operations; i++) {
+            Contact *contact = (Contact *)arenaAlloc(&book.storage, sizeof(Contact));
+            char *buffer = (char *)arenaAlloc(&book.storage, GENERATOR_BUFFER_SIZE);
+            if (!contact || !buffer) break;
+            generateContact(&options, (long long)size + more + i, contact, buffer);
+            clock_gettime(CLOCK_MONOTONIC, &started);
+            appendContact(&book, contact);
+            journalCommit(book.journal);
+            benchAdd(&result, secondsSince(&started));
+        }
+        benchReport(report, &result, first);
+        // The base file is left as it was, only the journal is thrown away
+        unlink(book.journal->journalPath);
+        closeJournal(book.journal);
+        book.journal = NULL;
+    }
+    freeAddressBook(&book);
+    return 1;
+}
+
+// Times loading, saving, snapshot saves and loads, listing, printing, appending, merging,
+// streamed merges, lookups, fuzzy searches, filters, inserting and removing (through the order
+// tree and on the vector) and journaled appends on generated books of each size and writes the
+// results to stdout as JSON. A snapshot must load back into the same text, a streamed merge
+// must write what the merge saves, and the indexes and columns must find what a scan finds, or
+// the run fails. The operations' own messages are sent to /dev/null meanwhile and errors go to
+// stderr.
+int runBenchmarks(int *sizes, int sizeCount) {
+    const char *directory = getenv("TMPDIR");
+    if (!directory || !*directory) directory = "/tmp";
+    char baseFile[512], moreFile[512], sortedFile[512], outputFile[512], snapshotFile[512];
+    int id = (int)getpid();
+    snprintf(baseFile, sizeof(baseFile), "%s/addressBook-bench-%d-book.txt", directory, id);
+    snprintf(moreFile, sizeof(moreFile), "%s/addressBook-bench-%d-import.txt", directory, id);
+    snprintf(sortedFile, sizeof(sortedFile), "%s/addressBook-bench-%d-sorted.txt", directory, id);
+    snprintf(outputFile, sizeof(outputFile), "%s/addressBook-bench-%d-output.txt", directory, id);
+    snprintf(snapshotFile, sizeof(snapshotFile), "%s/addressBook-bench-%d-snapshot.bin", directory, id);
+
+    FILE *report = openReport("runBenchmarks");
+    if (!report) return 0;
+
+    // Sizes run smallest first, so a process-wide peak RSS still belongs to the size reported
+    qsort(sizes, sizeCount, sizeof(int), compareInts);
+    fprintf(report, "{\n  \"threads\": %d,\n  \"seed\": %d,\n  \"collisionPercent\": %d,\n  \"nameLength\": %d,\n"
+            "  \"addressLength\": %d,\n  \"peakRssPerOperation\": %s,\n  \"results\": [",
+            workerThreadCount(), GENERATOR_DEFAULT_SEED, GENERATOR_DEFAULT_COLLISIONS, GENERATOR_DEFAULT_NAME_LENGTH,
+            GENERATOR_DEFAULT_ADDRESS_LENGTH, resetPeakRss() ? "true" : "false");
+    int first = 1;
+    int ok = 1;
+    for (int s = 0; ok && s < sizeCount; s++) {
+        if (sizes[s] < 1) continue;
+        ok = benchSize(report, sizes[s], baseFile, moreFile, sortedFile, outputFile, snapshotFile, &first);
+    }
+    fprintf(report, "\n  ]\n}\n");
+    unlink(baseFile);
+    unlink(moreFile);
+    unlink(sortedFile);
+    unlink(outputFile);
+    unlink(snapshotFile);
+    closeReport(report);
+    return ok;
+}
+
+#define STRESS_DEFAULT_SIZE 100000
+#define STRESS_DEFAULT_SECONDS 5
+
+// One reader of runStress: takes views until told to stop, reading a random contact of each
+typedef struct StressReader {
+    SharedBook *shared;
+    atomic_int *stop;
+    uint64_t state;
+    long long views;
+    long long backwards; // views older than the one this reader had before, never expected
+    long long checksum;  // keeps the reads from being optimised away
+} StressReader;
+
+void *runStressReader(void *arg) {
+    StressReader *reader = (StressReader *)arg;
+    long long last = 0;
+    while (!atomic_load(reader->stop)) {
+        BookView *view = acquireBookView(reader->shared);
+        if (view->generation < last) reader->backwards++;
+        last = view->generation;
+        if (view->count > 0) {
+            // The strings must still be readable although the writer may have replaced the book
+            Contact *contact = view->contacts[nextRandom(&reader->state) % (uint64_t)view->count];
+            reader->checksum += contact->age + (unsigned char)contact->familyName[0] + strlen(contact->address);
+        }
+        releaseBookView(view);
+        reader->views++;
+    }
+    return NULL;
+}
+
+// Runs readers taking views of a shared book while one writer keeps loading, appending,
+// merging and deleting, for the given number of seconds, and writes the views and writer
+// operations per second to stdout as JSON. Fails when a reader saw the book go back in time.
+int runStress(int size, int readerCount, int seconds) {
+    const char *directory = getenv("TMPDIR");
+    if (!directory || !*directory) directory = "/tmp";
+    char baseFile[512], moreFile[512];
+    int id = (int)getpid();
+    snprintf(baseFile, sizeof(baseFile), "%s/addressBook-stress-%d-book.txt", directory, id);
+    snprintf(moreFile, sizeof(moreFile), "%s/addressBook-stress-%d-import.txt", directory, id);
+    GeneratorOptions options = {0, size, GENERATOR_DEFAULT_COLLISIONS, GENERATOR_DEFAULT_NAME_LENGTH,
+                                GENERATOR_DEFAULT_ADDRESS_LENGTH, GENERATOR_DEFAULT_SEED};
+    int more = size / 10 > 0 ? size / 10 : 1;
+    FILE *report = openReport("runStress");
+    if (!report) return 0;
+    SharedBook shared;
+    StressReader *readers = (StressReader *)calloc(readerCount, sizeof(StressReader));
+    pthread_t *threads = (pthread_t *)calloc(readerCount, sizeof(pthread_t));
+    int generated = generateContacts(&options, baseFile) >= 0;
+    options.first = size;
+    options.count = more;
+    generated = generated && generateContacts(&options, moreFile) >= 0;
+    if (!readers || !threads || !generated || !initSharedBook(&shared)) {
+        if (!readers || !threads) fprintf(stderr, "Error: Memory allocation failed in runStress\n");
+        else fprintf(stderr, "Error: book not set up in runStress\n");
+        free(readers);
+        free(threads);
+        unlink(baseFile);
+        unlink(moreFile);
+        closeReport(report);
+        return 0;
+    }
+
+    atomic_int stop;
+    atomic_init(&stop, 0);
+    int started = 0;
+    for (; started < readerCount; started++) {
+        readers[started] = (StressReader){&shared, &stop, options.seed + started, 0, 0, 0};
+        if (pthread_create(&threads[started], NULL, runStressReader, &readers[started]) != 0) break;
+    }
+    // The writer cycles through the four changes, publishing a new view after each
+    long long operations[4] = {0, 0, 0, 0};
+    uint64_t state = options.seed;
+    struct timespec begun;
+    clock_gettime(CLOCK_MONOTONIC, &begun);
+    double elapsed = 0;
+    for (int step = 0; elapsed < seconds; step = (step + 1) % 4) {
+        AddressBook *book = lockSharedBook(&shared, 1);
+        int changed = 0;
+        switch (step) {
+            case 0: changed = loadContactsFromFile(book, baseFile) > 0; break;
+            case 1: changed = appendContactsFromFile(book, moreFile) > 0; break;
+            case 2: changed = mergeContactsFromFile(book, moreFile) > 0; break;
+            case 3:
+                useContactOrder(book);
+                for (int i = 0; i < more && book->count > 0; i++) {
+                    deleteContactAt(book, (int)(nextRandom(&state) % (uint64_t)book->count));
+                }
+                changed = 1;
+                break;
+        }
+        unlockSharedBook(&shared, changed);
+        operations[step]++;
+        elapsed = secondsSince(&begun);
+    }
+    atomic_store(&stop, 1);
+    long long views = 0, backwards = 0, checksum = 0;
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+        views += readers[t].views;
+        backwards += readers[t].backwards;
+        checksum += readers[t].checksum;
+    }
+    long long writes = operations[0] + operations[1] + operations[2] + operations[3];
+    fprintf(report, "{\n  \"size\": %d,\n  \"readers\": %d,\n  \"seconds\": %.3f,\n  \"views\": %lld,\n"
+            "  \"viewsPerSecond\": %.0f,\n  \"writerOperations\": %lld,\n  \"writerOperationsPerSecond\": %.2f,\n"
+            "  \"loads\": %lld,\n  \"appends\": %lld,\n  \"merges\": %lld,\n  \"deletes\": %lld,\n"
+            "  \"viewsPublished\": %lld,\n  \"viewsGoingBack\": %lld,\n  \"checksum\": %lld\n}\n",
+            size, started, elapsed, views, views / elapsed, writes, writes / elapsed, operations[0], operations[1],
+            operations[2], operations[3], shared.generation, backwards, checksum);
+    int ok = started == readerCount && backwards == 0;
+    if (started < readerCount) fprintf(stderr, "Error: %d of %d readers started in runStress\n", started, readerCount);
+    if (backwards > 0) fprintf(stderr, "Error: %lld views older than an earlier one in runStress\n", backwards);
+    freeSharedBook(&shared);
+    free(readers);
+    free(threads);
+    unlink(baseFile);
+    unlink(moreFile);
+    closeReport(report);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    if (getenv("ADDRESSBOOK_METRICS")) atexit(dumpMetricsAtExit);
+    if (argc == 3 && strcmp(argv[1], "--script") == 0) {
+        // Batch mode: run the script on an empty book and exit without showing the menu
+        AddressBook scriptBook;
+        if (!initAddressBook(&scriptBook)) return 1;
+        runCommandScript(&scriptBook, argv[2]);
+        freeAddressBook(&scriptBook);
+        return 0;
+    }
+    if (argc >= 4 && argc <= 8 && strcmp(argv[1], "--generate") == 0) {
+        // Generator mode: FILE COUNT [COLLISION_PERCENT [NAME_LENGTH [ADDRESS_LENGTH [SEED]]]]
+        GeneratorOptions options = {0, strtoll(argv[3], NULL, 10), GENERATOR_DEFAULT_COLLISIONS,
+                                    GENERATOR_DEFAULT_NAME_LENGTH, GENERATOR_DEFAULT_ADDRESS_LENGTH,
+                                    GENERATOR_DEFAULT_SEED};
+        if (argc > 4) options.collisionPercent = (int)strtol(argv[4], NULL, 10);
+        if (argc > 5) options.nameLength = (int)strtol(argv[5], NULL, 10);
+        if (argc > 6) options.addressLength = (int)strtol(argv[6], NULL, 10);
+        if (argc > 7) options.seed = strtoull(argv[7], NULL, 10);
+        return generateContacts(&options, argv[2]) < 0;
+    }
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) {
+        // Benchmark mode: the given book sizes, or the default ones, with JSON results on stdout
+        int defaultSizes[] = BENCH_DEFAULT_SIZES;
+        int *sizes = defaultSizes;
+        int sizeCount = sizeof(defaultSizes) / sizeof(defaultSizes[0]);
+        if (argc > 2) {
+            sizes = (int *)malloc((argc - 2) * sizeof(int));
+            if (!sizes) return 1;
+            sizeCount = argc - 2;
+            for (int i = 0; i < sizeCount; i++) {
+                long size = strtol(argv[i + 2], NULL, 10);
+                sizes[i] = size > 0 && size <= INT_MAX / 2 ? (int)size : 0;
+            }
+        }
+        int ok = runBenchmarks(sizes, sizeCount);
+        if (sizes != defaultSizes) free(sizes);
+        return !ok;
+    }
+    if (argc >= 2 && argc <= 5 && strcmp(argv[1], "--stress") == 0) {
+        // Stress mode: [SIZE [READERS [SECONDS]]], views and writer operations per second on stdout
+        long size = argc > 2 ? strtol(argv[2], NULL, 10) : STRESS_DEFAULT_SIZE;
+        long readers = argc > 3 ? strtol(argv[3], NULL, 10) : workerThreadCount();
+        long seconds = argc > 4 ? strtol(argv[4], NULL, 10) : STRESS_DEFAULT_SECONDS;
+        if (size < 1 || size > INT_MAX / 2) size = STRESS_DEFAULT_SIZE;
+        if (readers < 1 || readers > WORKER_MAX_THREADS) readers = workerThreadCount();
+        if (seconds < 1) seconds = STRESS_DEFAULT_SECONDS;
+        return !runStress((int)size, (int)readers, (int)seconds);
+    }
+    if ((argc == 5 || argc == 6) && strcmp(argv[1], "--stream-merge") == 0) {
+        // Streaming mode: merge INPUT into the saved book BOOK, writing OUTPUT, in bounded memory
+        long memoryMb = argc == 6 ? strtol(argv[5], NULL, 10) : STREAM_DEFAULT_MEMORY_MB;
+        if (memoryMb < 1) memoryMb = STREAM_DEFAULT_MEMORY_MB;
+        return mergeFilesStreaming(argv[2], argv[3], argv[4], (size_t)memoryMb << 20) < 0;
+    }
+    // The menu is the writer of a shared book so a background import can run while
+    // listing, saving and searching keep working on the last published view
+    SharedBook shared;
+    if (!initSharedBook(&shared)) return 1;
+    AddressBook *book = &shared.book;
+    BackgroundImport background = {NULL, "", 0, 0, 0};
+    BackgroundSaver saver;
+    initBackgroundSaver(&saver, &shared);
+    int choice;
+    char filename[256];
+
+    while (1) {
+        printf("\nAddress Book Menu\n");
+        printf("1. Append Contact\n");
+        printf("2. Insert Contact in Alphabetical Order\n");
+        printf("3. Remove Contact by Index\n");
+        printf("4. Remove Contact by Full Name\n");
+        printf("5. Find and Edit Contact\n");
+        printf("6. List Contacts\n");
+        printf("7. Print Contacts to File with the format of an input file\n");
+        printf("8. Print Contacts to File (Human Readable)\n");
+        printf("9. Load Contacts from File Replacing Existing Contacts\n");
+        printf("10. Append Contacts from File\n");
+        printf("11. Merge Contacts from File\n");
+        printf("12. Exit\n");
+        printf("13. Save Binary Snapshot\n");
+        printf("14. Load Binary Snapshot Replacing Existing Contacts\n");
+        printf("15. Open Journaled Address Book\n");
+        printf("16. Compact Journal into its Base File\n");
+        printf("17. Find Contacts by Phone Number\n");
+        printf("18. Find Contacts by Name Prefix\n");
+        printf("19. Run Command Script\n");
+        printf("20. Import Contacts from File in the Background\n");
+        printf("21. Filter Contacts by Age, Area Code and Family Name\n");
+        printf("22. Fuzzy Search Contacts\n");
+        printf("23. Merge Large Files without Loading them\n");
+        printf("24. Show Metrics\n");
+        printf("25. Autosave Periodically\n");
+        printf("Choose an option: ");
+        scanf("%d", &choice);
+        while (getchar() != '\n');
+
+        // Listing and saving read a view, saves are then written by the saver thread; searches
+        // use the indexes unless an import holds the book; everything else waits for the
+        // writer side. Options opening files first wait for queued saves of the same files.
+        BookView *view = NULL;
+        int locked = 0;
+        int changed = 0; // set by the options that changed the book, only then is a new view published
+        if (choice == 12) {
+            finishBackgroundImport(&background);
+            stopBackgroundSaver(&saver);
+        }
+        if ((choice >= 9 && choice <= 11) || (choice >= 14 && choice <= 16) || choice == 19 || choice == 20 ||
+            choice == 23) {
+            finishBackgroundSaves(&saver);
+        }
+        if (choice == 6 || choice == 7 || choice == 8 || choice == 13) {
+            view = acquireBookView(&shared);
+        } else if (choice == 17 || choice == 18 || choice == 21 || choice == 22) {
+            locked = lockSharedBook(&shared, 0) != NULL;
+            if (!locked) view = acquireBookView(&shared);
+        } else if (choice != 20 && choice != 23 && choice != 24 && choice != 25) {
+            if (!lockSharedBook(&shared, 0)) {
+                printf("Waiting for the background import to finish...\n");
+                lockSharedBook(&shared, 1);
+            }
+            locked = 1;
+        }
+
+        switch (choice) {
+            case 1: {
+                Contact *newContact = readNewContact(book);
+                changed = appendContact(book, newContact);
+                break;
+            }
+            case 2: {
+                Contact *newContact = readNewContact(book);
+                changed = insertContactAlphabetical(book, newContact);
+                break;
+            }
+            case 3:
+                changed = removeContactByIndex(book);
+                break;
+            case 4:
+                changed = removeContactByFullName(book) == 1;
+                break;
+            case 5: {
+                int index;
+                printf("Enter index to edit (0-based): ");
+                scanf("%d", &index);
+                while (getchar() != '\n');
+                // Edits replace the contact with a copy, so it changed when another one is returned
+                Contact *original = index >= 0 && index < countContacts(book) ? bookContactAt(book, index) : NULL;
+                Contact *edited = editContact(book, index);
+                changed = edited != original;
+                break;
+            }
+            case 6:
+                listBookView(view);
+                break;
+            case 7:
+                printf("Enter filename: ");
+                fgets(filename, sizeof(filename), stdin);
+                filename[strcspn(filename, "\n")] = 0;
+                queueBackgroundSave(&saver, view, filename, SAVE_CONTACTS);
+                break;
+            case 8:
+                printf("Enter filename: ");
+                fgets(filename, sizeof(filename), stdin);
+                filename[strcspn(filename, "\n")] = 0;
+                queueBackgroundSave(&saver, view, filename, SAVE_REPORT);
+                break;
+            case 9: {
+                printf("Enter filename: ");
+                fgets(filename, sizeof(filename), stdin);
+                filename[strcspn(filename, "\n")] = 0;
+                // A failed load leaves the book alone, an empty file only changes a book that had contacts
+                int before = countContacts(book);
+                changed = loadContactsFromFile(book, filename) > 0 || countContacts(book) != before;
+                break;
+            }
+            case 10:
+                printf("Enter filename: ");
+                fgets(filename, sizeof(filename), stdin);
+                filename[strcspn(filename, "\n")] = 0;
+                changed = appendContactsFromFile(book, filename) > 0;
+                break;
+            case 11:
+                printf("Enter filename: ");
+                fgets(filename, sizeof(filename), stdin);
+                filename[strcspn(filename, "\n")] = 0;
+                changed = mergeContactsFromFile(book, filename) > 0;
+                break;
+            case 12:
+                closeJournal(book->journal);
+                book->journal = NULL;
+                pthread_mutex_unlock(&shared.writeLock);
+                freeSharedBook(&shared);
+                return 0;
+            case 13:
+                printf("Enter filename: ");
+                fgets(filename, sizeof(filename), stdin);
+                filename[strcspn(filename, "\n")] = 0;
+                queueBackgroundSave(&saver, view, filename, SAVE_SNAPSHOT);
+                break;
+            case 14: {
+                printf("Enter filename: ");
+                fgets(filename, sizeof(filename), stdin);
+                filename[strcspn(filename, "\n")] = 0;
+                int before = countContacts(book);
+                changed = loadSnapshotFromFile(book, filename) > 0 || countContacts(book) != before;
+                break;
+            }
+            case 15: {
+                int policy;
+                printf("Enter base filename: ");
+                fgets(filename, sizeof(filename), stdin);
+                filename[strcspn(filename, "\n")] = 0;
+                printf("Sync journal writes (0 = every change, 1 = once per menu operation, 2 = leave to the OS): ");
+                if (scanf("%d", &policy) != 1 || policy < JOURNAL_FSYNC_ALWAYS || policy > JOURNAL_FSYNC_NEVER) {
+                    policy = JOURNAL_FSYNC_BATCH;
+                }
+                while (getchar() != '\n');
+                openJournal(book, filename, policy);
+                changed = 1; // the book is replaced by the base file even when the journal cannot be opened
+                break;
+            }
+            case 16:
+                if (compactJournal(book)) printf("Journal compacted into %s\n", book->journal->basePath);
+                break;
+            case 17: {
+                long long phoneNum;
+                ContactBatch results = {NULL, 0, 0};
+                printf("Enter phone number: ");
+                if (scanf("%lld", &phoneNum) != 1) phoneNum = -1;
+                while (getchar() != '\n');
+                if (locked) findContactsByPhone(book, phoneNum, &results);
+                else findViewContactsByPhone(view, phoneNum, &results);
+                listMatches(&results);
+                free(results.items);
+                break;
+            }
+            case 18: {
+                int field;
+                char prefix[256];
+                ContactBatch results = {NULL, 0, 0};
+                printf("Search by 1. Family Name or 2. First Name: ");
+                if (scanf("%d", &field) != 1) field = 1;
+                while (getchar() != '\n');
+                printf("Enter prefix: ");
+                fgets(prefix, sizeof(prefix), stdin);
+                prefix[strcspn(prefix, "\n")] = 0;
+                if (locked) findContactsByPrefix(book, prefix, field == 2, &results);
+                else findViewContactsByPrefix(view, prefix, field == 2, &results);
+                listMatches(&results);
+                free(results.items);
+                break;
+            }
+            case 19:
+                printf("Enter script filename: ");
+                fgets(filename, sizeof(filename), stdin);
+                filename[strcspn(filename, "\n")] = 0;
+                changed = runCommandScript(book, filename) > 0;
+                break;
+            case 20: {
+                int merge;
+                printf("Enter filename: ");
+                fgets(filename, sizeof(filename), stdin);
+                filename[strcspn(filename, "\n")] = 0;
+                printf("1. Append or 2. Merge: ");
+                if (scanf("%d", &merge) != 1) merge = 1;
+                while (getchar() != '\n');
+                startBackgroundImport(&background, &shared, filename, merge == 2);
+                break;
+            }
+            case 21: {
+                int minAge, maxAge, firstCode, lastCode, list;
+                char prefix[256];
+                ContactBatch results = {NULL, 0, 0};
+                ContactAggregate aggregate;
+                ContactFilter filter = {INT_MIN, INT_MAX, LLONG_MIN, LLONG_MAX, prefix};
+                printf("Enter minimum and maximum age (0 0 for any): ");
+                if (scanf("%d %d", &minAge, &maxAge) == 2 && (minAge != 0 || maxAge != 0)) {
+                    filter.minAge = minAge;
+                    filter.maxAge = maxAge;
+                }
+                while (getchar() != '\n');
+                // An area code is the first three of ten digits
+                printf("Enter first and last area code (0 0 for any): ");
+                if (scanf("%d %d", &firstCode, &lastCode) == 2 && (firstCode != 0 || lastCode != 0)) {
+                    filter.minPhone = firstCode * 10000000LL;
+                    filter.maxPhone = (lastCode + 1) * 10000000LL - 1;
+                }
+                while (getchar() != '\n');
+                printf("Enter family name prefix (empty for any): ");
+                fgets(prefix, sizeof(prefix), stdin);
+                prefix[strcspn(prefix, "\n")] = 0;
+                printf("List the matching contacts? 1. Yes or 2. No: ");
+                if (scanf("%d", &list) != 1) list = 2;
+                while (getchar() != '\n');
+                ContactBatch *listed = list == 1 ? &results : NULL;
+                int ok = locked ? findContactsByFilter(book, &filter, listed, &aggregate)
+                                : findViewContactsByFilter(view, &filter, listed, &aggregate);
+                if (ok) {
+                    if (list == 1) listMatches(&results);
+                    printAggregate(&aggregate);
+                }
+                free(results.items);
+                break;
+            }
+            case 22: {
+                int field, maxDistance;
+                char text[256];
+                FuzzyMatch matches[FUZZY_LIST_LIMIT];
+                printf("Search 1. Full Name, 2. First Name, 3. Family Name or 4. Address: ");
+                if (scanf("%d", &field) != 1 || field < 1 || field > FUZZY_KEY_COUNT) field = 1;
+                while (getchar() != '\n');
+                printf("Enter search text: ");
+                fgets(text, sizeof(text), stdin);
+                text[strcspn(text, "\n")] = 0;
+                printf("Enter maximum number of differences (0 to %d): ", FUZZY_MAX_DISTANCE);
+                if (scanf("%d", &maxDistance) != 1) maxDistance = 2;
+                while (getchar() != '\n');
+                int found = locked ? findContactsFuzzy(book, field - 1, text, maxDistance, FUZZY_LIST_LIMIT, matches)
+                                   : findViewContactsFuzzy(view, field - 1, text, maxDistance, FUZZY_LIST_LIMIT, matches);
+                if (found == 0) printf("No matching contacts.\n");
+                for (int i = 0; i < found; i++) {
+                    Contact *contact = matches[i].contact;
+                    char number[ADDRESS_NUMBER_SIZE];
+                    number[formatAddressNumber(number, contact)] = '\0';
+                    printf("%d. %s %s (%d differences)\nPhone: %lld\nAddress: %s%s\nAge: %d\n", i + 1,
+                           contact->firstName, contact->familyName, matches[i].distance, contact->phoneNum,
+                           number, contact->address, contact->age);
+                }
+                break;
+            }
+            case 23: {
+                // Works on the files only, the book in memory is left alone
+                char bookFile[256], outputFile[256];
+                long memoryMb;
+                printf("Enter saved book filename (empty for none): ");
+                fgets(bookFile, sizeof(bookFile), stdin);
+                bookFile[strcspn(bookFile, "\n")] = 0;
+                printf("Enter filename to merge: ");
+                fgets(filename, sizeof(filename), stdin);
+                filename[strcspn(filename, "\n")] = 0;
+                printf("Enter output filename: ");
+                fgets(outputFile, sizeof(outputFile), stdin);
+                outputFile[strcspn(outputFile, "\n")] = 0;
+                printf("Enter memory limit in MB (0 for %d): ", STREAM_DEFAULT_MEMORY_MB);
+                if (scanf("%ld", &memoryMb) != 1 || memoryMb < 1) memoryMb = STREAM_DEFAULT_MEMORY_MB;
+                while (getchar() != '\n');
+                mergeFilesStreaming(bookFile, filename, outputFile, (size_t)memoryMb << 20);
+                break;
+            }
+            case 24: {
+                int format;
+                printf("Show as 1. Text or 2. JSON: ");
+                if (scanf("%d", &format) != 1) format = 1;
+                while (getchar() != '\n');
+                dumpMetrics(stdout, format == 2);
+                break;
+            }
+            case 25: {
+                int seconds;
+                printf("Enter filename (empty to stop autosaving): ");
+                fgets(filename, sizeof(filename), stdin);
+                filename[strcspn(filename, "\n")] = 0;
+                printf("Enter interval in seconds: ");
+                if (scanf("%d", &seconds) != 1) seconds = 0;
+                while (getchar() != '\n');
+                setAutosave(&saver, filename, seconds);
+                break;
+            }
+            default:
+                printf("Invalid option. Please try again.\n");
+        }
+        if (locked) {
+            if (book->journal) journalCommit(book->journal);
+            unlockSharedBook(&shared, changed);
+        }
+        if (view) releaseBookView(view);
+    }
+    return 0;
 }
\ No newline at end of file